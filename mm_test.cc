@@ -15,6 +15,7 @@
 
 #include <deal.II/fe/fe_q.h>
 #include <deal.II/fe/fe_system.h>
+#include <deal.II/fe/mapping_q_eulerian.h>
 
 #include <deal.II/lac/trilinos_vector.h>
 #include <deal.II/lac/constraint_matrix.h>
@@ -22,6 +23,7 @@
 #include <iostream>
 #include <stdlib.h>
 #include <time.h>
+#include <memory>
 
 #include "myheaders/mesh_struct.h"
 
@@ -30,7 +32,17 @@ using namespace dealii;
 template <int dim>
 class mm_test{
 public:
-    mm_test();
+    //! If #z_only is true the mesh vertices are stored as a scalar field of the vertical coordinate only.
+    //! If #eulerian is true the triangulation is never moved and the deformation is described by a MappingQEulerian.
+    //! The Eulerian mapping needs all #dim components, therefore it overrides #z_only.
+    //! If #column_partition is true the coarse grid has one layer of cells in the vertical direction and each
+    //! x-y column is kept on one processor.
+    //! If #cost_balance is true the cells are weighted by the work of the mesh structure and the triangulation
+    //! is repartitioned only when the work is imbalanced.
+    //! If #elevation_operator is true the elevations are computed with the assembled elevation operator
+    //! instead of the exchange of the elevations between the processors
+    mm_test(bool z_only = false, bool eulerian = false, bool column_partition = false, bool cost_balance = false,
+            bool elevation_operator = false);
     ~mm_test();
 
     void run();
@@ -52,13 +64,28 @@ private:
 
     Mesh_struct<dim>                            mesh_struct;
 
+    //! True if the deformation is described by #euler_mapping instead of moving the triangulation
+    bool                                        eulerian;
+    //! The displacement of the vertices from the reference triangulation (with ghost entries)
+    TrilinosWrappers::MPI::Vector               mesh_displacement;
+    std::unique_ptr<MappingQEulerian<dim, TrilinosWrappers::MPI::Vector> > euler_mapping;
+    //! True if the cells of each x-y column are kept on one processor
+    bool                                        column_partition;
+    //! True if the partitioning balances the measured work of the mesh structure
+    bool                                        cost_balance;
+    //! True if the elevations are computed with the elevation operator
+    bool                                        elevation_operator;
+
     void make_grid();
     void refine_transfer(std::string prefix);
     void refine_transfer1();
+    void undo_displacement();
+    void update_displacement();
 
     void do_one_random_refinement(double top_fraction, double bottom_fraction);
     void set_initial_grid();
     void simulate(RBF<dim-1>& rbf);
+    void update_elevations(RBF<dim-1>& rbf, std::string prefix);
     void flag_cells_4_refinement();
 
 
@@ -66,23 +93,42 @@ private:
 };
 
 template <int dim>
-mm_test<dim>::mm_test()
+mm_test<dim>::mm_test(bool z_only, bool eulerian_, bool column_partition_, bool cost_balance_, bool elevation_operator_)
     :
     mpi_communicator (MPI_COMM_WORLD),
     triangulation (mpi_communicator,
                     typename Triangulation<dim>::MeshSmoothing
                     (Triangulation<dim>::smoothing_on_refinement |
-                    Triangulation<dim>::limit_level_difference_at_vertices)),
+                    Triangulation<dim>::limit_level_difference_at_vertices),
+                    (column_partition_ || cost_balance_) ? parallel::distributed::Triangulation<dim>::no_automatic_repartitioning
+                                      : parallel::distributed::Triangulation<dim>::default_setting),
     mesh_dof_handler (triangulation),
-    mesh_fe (FE_Q<dim>(1),dim),
+    mesh_fe (FE_Q<dim>(1), (z_only && !eulerian_) ? 1 : dim),
     mesh_struct(0.0001,0.0001),
-    pcout(std::cout,(Utilities::MPI::this_mpi_process(mpi_communicator) == 0))
+    pcout(std::cout,(Utilities::MPI::this_mpi_process(mpi_communicator) == 0)),
+    eulerian(eulerian_),
+    column_partition(column_partition_),
+    cost_balance(cost_balance_),
+    elevation_operator(elevation_operator_)
 {
+    // The weights must be in place before the grid is created and partitioned
+    if (column_partition)
+        mesh_struct.align_columns(triangulation);
+    if (cost_balance)
+        mesh_struct.cost_weights(triangulation);
     make_grid();
+    // rebuild the mesh structure only when the triangulation changes
+    mesh_struct.track_topology(triangulation);
+    if (eulerian){
+        // The triangulation stays in reference coordinates
+        mesh_struct.move_triangulation = false;
+        euler_mapping.reset(new MappingQEulerian<dim, TrilinosWrappers::MPI::Vector>(1, mesh_dof_handler, mesh_displacement));
+    }
 }
 
 template <int dim>
 mm_test<dim>::~mm_test(){
+    euler_mapping.reset();
     mesh_dof_handler.clear();
 }
 
@@ -93,11 +139,11 @@ void mm_test<dim>::make_grid(){
     std::vector<unsigned int>	n_cells;
     if (dim == 2) {
         right_top[0] = 10000; right_top[1] = 1000;
-        n_cells.push_back(20); n_cells.push_back(5);
+        n_cells.push_back(20); n_cells.push_back(column_partition ? 1 : 5);
     }
     else if (dim == 3){
         right_top[0] = 10000; right_top[1] = 10000; right_top[2] = 1000;
-        n_cells.push_back(10); n_cells.push_back(10); n_cells.push_back(3);
+        n_cells.push_back(10); n_cells.push_back(10); n_cells.push_back(column_partition ? 1 : 3);
     }
 
     GridGenerator::subdivided_hyper_rectangle(triangulation,
@@ -130,20 +176,17 @@ void mm_test<dim>::set_initial_grid(){
 
     double tt = 300;
     double bb = 0;
-    typename std::map<int , PntsInfo<dim> >::iterator it;
-    for (it = mesh_struct.PointsMap.begin(); it != mesh_struct.PointsMap.end(); ++it){
-        std::vector<Zinfo>::iterator itz = it->second.Zlist.begin();
-        for (; itz != it->second.Zlist.end(); ++itz){
-            if (itz->is_local){
-                itz->rel_pos = (itz->z - itz->Bot.z)/(itz->Top.z - itz->Bot.z);
-                if (itz->isTop){
-                    itz->z = tt;
-                    itz->isZset = true;
-                }
-                if (itz->isBot){
-                    itz->z = bb;
-                    itz->isZset = true;
-                }
+    for (int i = 0; i < mesh_struct.Columns.n_nodes(); ++i){
+        Zinfo itz(mesh_struct.Columns, i);
+        if (itz.is_local()){
+            itz.rel_pos() = (itz.z() - itz.Bot().z)/(itz.Top().z - itz.Bot().z);
+            if (itz.isTop()){
+                itz.z() = tt;
+                itz.set_Zset(true);
+            }
+            if (itz.isBot()){
+                itz.z() = bb;
+                itz.set_Zset(true);
             }
         }
     }
@@ -158,6 +201,16 @@ void mm_test<dim>::set_initial_grid(){
                                     mpi_communicator,
                                     pcout,
                                     "iter0");
+    if (eulerian)
+        update_displacement();
+}
+
+template <int dim>
+void mm_test<dim>::update_displacement(){
+    TrilinosWrappers::MPI::Vector distributed_displacement(mesh_locally_owned, mpi_communicator);
+    mesh_struct.compute_displacement(mesh_dof_handler, mesh_vertices, distributed_displacement);
+    mesh_displacement.reinit(mesh_locally_owned, mesh_locally_relevant, mpi_communicator);
+    mesh_displacement = distributed_displacement;
 }
 
 template <int dim>
@@ -234,6 +287,8 @@ void mm_test<dim>::refine_transfer(std::string prefix){
 
     //For the mesh
     mesh_dof_handler.distribute_dofs(mesh_fe); // distribute the dofs again
+    // The solution transfer needs the new dofs before updateMeshStruct, so they are renumbered here as well
+    mesh_struct.renumber_columns(mesh_dof_handler);
     std::cout << "dofs 4: " << mesh_dof_handler.n_dofs() << std::endl << std::flush;
     mesh_locally_owned = mesh_dof_handler.locally_owned_dofs();
     DoFTools::extract_locally_relevant_dofs (mesh_dof_handler, mesh_locally_relevant);
@@ -256,6 +311,26 @@ void mm_test<dim>::refine_transfer(std::string prefix){
 
 template <int dim>
 void mm_test<dim>::refine_transfer1(){
+    // With the Eulerian mapping the triangulation was never moved, so there is nothing to undo
+    if (!eulerian)
+        undo_displacement();
+
+    // Let the mesh structure know which columns are going to change
+    triangulation.prepare_coarsening_and_refinement();
+    mesh_struct.flag_changed_columns(triangulation);
+    triangulation.execute_coarsening_and_refinement ();
+    // Move the columns that have been split by the refinement back to one processor, and
+    // balance the work if the last update of the mesh structure was imbalanced
+    if (column_partition || (cost_balance && mesh_struct.is_imbalanced(mpi_communicator, pcout)))
+        triangulation.repartition();
+    // The column weights do not guarantee that the columns are not split, so check it
+    if (column_partition && !mesh_struct.columns_on_one_processor(triangulation, mpi_communicator))
+        pcout << "Some x-y columns are split between processors after the repartition" << std::endl;
+    // The mesh dofs are not distributed here. updateMeshStruct distributes them and renumbers them column by column
+}
+
+template <int dim>
+void mm_test<dim>::undo_displacement(){
     std::vector<bool> locally_owned_vertices = triangulation.get_used_vertices();
     {
         // Create the boolean input of communicate_locally_moved_vertices method
@@ -286,7 +361,10 @@ void mm_test<dim>::refine_transfer1(){
                 for (unsigned int vertex_no = 0; vertex_no < GeometryInfo<dim>::vertices_per_cell; ++vertex_no){
                     Point<dim> &v=cell->vertex(vertex_no);
                     for (unsigned int dir=0; dir < dim; ++dir){
-                        types::global_dof_index dof = cell->vertex_dof_index(vertex_no, dir);
+                        const int comp = vertex_component<dim>(mesh_fe, dir);
+                        if (comp < 0)
+                            continue;
+                        types::global_dof_index dof = cell->vertex_dof_index(vertex_no, comp);
                         it_set = set_dof.find(dof);
                         if (it_set == set_dof.end()){
                             v(dir) = v(dir) - mesh_Offset_vertices(dof);
@@ -300,8 +378,7 @@ void mm_test<dim>::refine_transfer1(){
 
     triangulation.communicate_locally_moved_vertices(locally_owned_vertices);
     // now the mesh should be consistent as when it was first created
-    // so we can hopefully refine it
-    triangulation.execute_coarsening_and_refinement ();
+    // so we can hopefully refine it.
 }
 
 template <int dim>
@@ -309,7 +386,12 @@ void mm_test<dim>::run(){
     unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
 
     set_initial_grid();
-    mesh_struct.printMesh("animAfter_0", my_rank,mesh_dof_handler);
+    mesh_struct.printMesh("animAfter_0", my_rank,mesh_dof_handler, euler_mapping.get());
+    // From now on the refinements go through refine_transfer1 which flags the changed columns
+    mesh_struct.incremental_update = true;
+    // The elevation operator is assembled once after each refinement. Otherwise the elevations are exchanged
+    // with a plan that is recorded once after each refinement
+    mesh_struct.use_elevation_operator = elevation_operator;
 
     RBF<dim-1> rbf;
     for (unsigned int iter = 0; iter < 5; ++iter){
@@ -317,55 +399,65 @@ void mm_test<dim>::run(){
         simulate(rbf);
         flag_cells_4_refinement();
         refine_transfer1();
+        update_elevations(rbf, "iter" + std::to_string(iter+1));
 
-        mesh_struct.updateMeshStruct(mesh_dof_handler,
-                                     mesh_fe,
-                                     mesh_constraints,
-                                     mesh_locally_owned,
-                                     mesh_locally_relevant,
-                                     mesh_vertices,
-                                     distributed_mesh_vertices,
-                                     mesh_Offset_vertices,
-                                     distributed_mesh_Offset_vertices,
-                                     mpi_communicator,
-                                     pcout,
-                                     "iter0");
-
-        { // Set the new elevations
-            double tt = 300;
-            double bb = 0;
-            typename std::map<int , PntsInfo<dim> >::iterator it;
-            for (it = mesh_struct.PointsMap.begin(); it != mesh_struct.PointsMap.end(); ++it){
-                std::vector<Zinfo>::iterator itz = it->second.Zlist.begin();
-                for (; itz != it->second.Zlist.end(); ++itz){
-                    if (itz->is_local){
-                        itz->rel_pos = (itz->z - itz->Bot.z)/(itz->Top.z - itz->Bot.z);
-                        if (itz->isTop){
-                            itz->z = tt + rbf.eval(it->second.PNT);
-                            itz->isZset = true;
-                        }
-                        if (itz->isBot){
-                            itz->z = bb;
-                            itz->isZset = true;
-                        }
+        // A second update without refinement reuses the mesh structure and replays the exchange plan of the elevations
+        simulate(rbf);
+        update_elevations(rbf, "iter" + std::to_string(iter+1) + "b");
+
+        mesh_struct.printMesh("animAfter_" + std::to_string(iter+1) , my_rank, mesh_dof_handler, euler_mapping.get());
+    }
+}
+
+template <int dim>
+void mm_test<dim>::update_elevations(RBF<dim-1>& rbf, std::string prefix){
+    mesh_struct.updateMeshStruct(mesh_dof_handler,
+                                 mesh_fe,
+                                 mesh_constraints,
+                                 mesh_locally_owned,
+                                 mesh_locally_relevant,
+                                 mesh_vertices,
+                                 distributed_mesh_vertices,
+                                 mesh_Offset_vertices,
+                                 distributed_mesh_Offset_vertices,
+                                 mpi_communicator,
+                                 pcout,
+                                 prefix);
+
+    { // Set the new elevations
+        double tt = 300;
+        double bb = 0;
+        for (int ic = 0; ic < mesh_struct.Columns.n_columns(); ++ic){
+            PntsInfo<dim> pnt(mesh_struct.Columns, ic);
+            for (int k = 0; k < pnt.size(); ++k){
+                Zinfo itz = pnt.Z(k);
+                if (itz.is_local()){
+                    itz.rel_pos() = (itz.z() - itz.Bot().z)/(itz.Top().z - itz.Bot().z);
+                    if (itz.isTop()){
+                        itz.z() = tt + rbf.eval(pnt.PNT());
+                        itz.set_Zset(true);
+                    }
+                    if (itz.isBot()){
+                        itz.z() = bb;
+                        itz.set_Zset(true);
                     }
                 }
             }
         }
-
-        mesh_struct.updateMeshElevation(mesh_dof_handler,
-                                        triangulation,
-                                        mesh_constraints,
-                                        mesh_vertices,
-                                        distributed_mesh_vertices,
-                                        mesh_Offset_vertices,
-                                        distributed_mesh_Offset_vertices,
-                                        mpi_communicator,
-                                        pcout,
-                                        "iter0");
-
-        mesh_struct.printMesh("animAfter_" + std::to_string(iter+1) , my_rank, mesh_dof_handler);
     }
+
+    mesh_struct.updateMeshElevation(mesh_dof_handler,
+                                    triangulation,
+                                    mesh_constraints,
+                                    mesh_vertices,
+                                    distributed_mesh_vertices,
+                                    mesh_Offset_vertices,
+                                    distributed_mesh_Offset_vertices,
+                                    mpi_communicator,
+                                    pcout,
+                                    prefix);
+    if (eulerian)
+        update_displacement();
 }
 
 //! Cells with random value below #refine_perc will be refined, and cells with random value above #coarse_perc will be coarsen
@@ -390,6 +482,40 @@ void mm_test<dim>::do_one_random_refinement(double refine_perc, double coarse_pe
 
 }
 
+//! The modes of one run of the test. See the constructor of #mm_test
+struct mm_test_modes{
+    mm_test_modes()
+        :
+          z_only(false),
+          eulerian(false),
+          column_partition(false),
+          cost_balance(false),
+          elevation_operator(false)
+    {}
+    bool z_only;
+    bool eulerian;
+    bool column_partition;
+    bool cost_balance;
+    bool elevation_operator;
+};
+
+//! Sets the mode that the command line argument #arg names. Returns false if #arg is not a mode
+bool parse_mode(const std::string& arg, mm_test_modes& modes){
+    if (arg == "column_partition")
+        modes.column_partition = true;
+    else if (arg == "z_only")
+        modes.z_only = true;
+    else if (arg == "eulerian")
+        modes.eulerian = true;
+    else if (arg == "cost_balance")
+        modes.cost_balance = true;
+    else if (arg == "elevation_operator")
+        modes.elevation_operator = true;
+    else
+        return false;
+    return true;
+}
+
 int main (int argc, char **argv){
     deallog.depth_console (1);
 
@@ -399,12 +525,43 @@ int main (int argc, char **argv){
     srand(rr);
     //srand(1517505046);
     //srand(1522316091);
-    Utilities::MPI::MPI_InitFinalize mpi_initialization(argc, argv, 1);
-
-    //This is going to create a box with uniform bottom at 0 and uniform top 100
-    mm_test<3> mm;
-    mm.run();
+    // Let each processor use all the threads it has. deal.II initializes MPI for threaded use in that case
+    // and only the main thread makes MPI calls
+    Utilities::MPI::MPI_InitFinalize mpi_initialization(argc, argv, numbers::invalid_unsigned_int);
+
+    // The modes are given in the command line, e.g. mpirun -np 4 ./mm_test column_partition
+    // Without arguments the test runs once with the default modes and once with each mode on its own
+    std::vector<mm_test_modes> runs;
+    mm_test_modes modes;
+    for (int i = 1; i < argc; ++i){
+        if (!parse_mode(argv[i], modes))
+            std::cerr << "Unknown mode " << argv[i] << std::endl;
+    }
+    runs.push_back(modes);
+    if (argc == 1){
+        mm_test_modes column_modes;
+        column_modes.column_partition = true;
+        runs.push_back(column_modes);
+        mm_test_modes z_only_modes;
+        z_only_modes.z_only = true;
+        runs.push_back(z_only_modes);
+        mm_test_modes eulerian_modes;
+        eulerian_modes.eulerian = true;
+        runs.push_back(eulerian_modes);
+        mm_test_modes cost_balance_modes;
+        cost_balance_modes.cost_balance = true;
+        runs.push_back(cost_balance_modes);
+        mm_test_modes elevation_operator_modes;
+        elevation_operator_modes.elevation_operator = true;
+        runs.push_back(elevation_operator_modes);
+    }
 
+    for (unsigned int i = 0; i < runs.size(); ++i){
+        //This is going to create a box with uniform bottom at 0 and uniform top 100
+        mm_test<3> mm(runs[i].z_only, runs[i].eulerian, runs[i].column_partition, runs[i].cost_balance,
+                      runs[i].elevation_operator);
+        mm.run();
+    }
 
     return 0;
 }
@@ -0,0 +1,500 @@
+#ifndef COLUMN_STORE_H
+#define COLUMN_STORE_H
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <functional>
+
+#include <deal.II/base/parallel.h>
+
+#include "xy_hash.h"
+
+/*! \file column_store.h
+    \brief Flat storage of the mesh vertical columns.
+
+    All the z nodes of all the x-y columns are kept in a small number of contiguous arrays
+    in a CSR fashion. The node k of column i lives at index #Column_store::col_ptr[i] + k of
+    the per node arrays. The #PntsInfo and #Zinfo classes are only views over this storage.
+*/
+
+/*!
+ * \brief The DOFZ struct is a helper struct to hold some information about a given node.
+ * It is used in the #Zinfo class to hold the information about the top and bottom nodes of
+ * a given node
+ */
+struct DOFZ{
+    //! The degree of freedom
+    int dof;
+    //! The Z coordinate
+    double z;
+    //! the id in the Zlist that this node can be found (NOT SURE IF I"LL USE THIS).
+    int id;
+    //! The processor id that this node is locally owned. If the id is negative then
+    //! the node with #dof lives in another processor but we dont know in which
+    //! processor it lives. Therefore if the #proc is negative #z, #id are also negative
+    //! and the #isSet is false.
+    int proc;
+    //! isSet gets true during the #Mesh_struct<dim>::updateMeshElevation method.
+    bool isSet;
+
+    void dummy_values(){
+        dof = -9;
+        z = -9999;
+        id = -9;
+        proc = -9;
+        isSet = false;
+    }
+};
+
+//! The bits of the #Column_store::flags array. Each z node packs all its boolean
+//! information into a single byte.
+enum Zflag{
+    //! The node lays on the top surface of the mesh
+    ZF_TOP          = 1 << 0,
+    //! The node lays on the bottom of the mesh
+    ZF_BOT          = 1 << 1,
+    //! The dof of the node is locally owned
+    ZF_LOCAL        = 1 << 2,
+    //! The elevation of the node has been updated at the current iteration
+    ZF_ZSET         = 1 << 3,
+    //! The node is connected with the node above
+    ZF_CONN_ABOVE   = 1 << 4,
+    //! The node is connected with the node below
+    ZF_CONN_BELOW   = 1 << 5,
+    //! The node is a hanging node
+    ZF_HANGING      = 1 << 6
+};
+
+/*!
+ * \brief The Znode_rec struct is a z node as it is found while looping through the cells.
+ * The records are gathered in a flat list and are sorted and merged once at the end by #Column_store::build
+ */
+struct Znode_rec{
+    //! The id of the column this node belongs to
+    int col;
+    //! The elevation
+    double z;
+    //! The dof of the vertical component of the node
+    int dof;
+    //! Any combination of #ZF_TOP, #ZF_BOT and #ZF_LOCAL
+    unsigned char flags;
+};
+
+//! Sort the node records by column and then by elevation
+inline bool sort_Znode_rec(const Znode_rec& A, const Znode_rec& B){
+    if (A.col != B.col)
+        return A.col < B.col;
+    return A.z < B.z;
+}
+
+//! Sorts by elevation the records of the columns [#begin, #end). The records of column c are in [#ptr[c], #ptr[c+1])
+inline void sort_Znode_columns(const std::vector<int>& ptr, std::vector<Znode_rec>& recs, int begin, int end){
+    for (int c = begin; c < end; ++c)
+        std::sort(recs.begin() + ptr[c], recs.begin() + ptr[c+1], sort_Znode_rec);
+}
+
+class Column_store{
+public:
+    Column_store();
+
+    //! Deletes everything
+    void clear();
+
+    //! Adds a new empty column at x, y and returns its id. In 2D the y should be 0.
+    int add_column(double x, double y);
+
+    //! Returns the number of columns
+    int n_columns() const {return static_cast<int>(X.size());}
+
+    //! Returns the total number of z nodes
+    int n_nodes() const {return static_cast<int>(z.size());}
+
+    //! Returns true if any column has no nodes
+    bool has_empty_columns() const;
+
+    //! Returns the number of z nodes of the column #col
+    int column_size(int col) const {return col_ptr[col+1] - col_ptr[col];}
+
+    //! Returns the index in the per node arrays of the #k node of the column #col
+    int id(int col, int k) const {return col_ptr[col] + k;}
+
+    /*!
+     * \brief build creates the per node arrays from the node records that have been gathered during the cell loop.
+     * The records of each column are sorted in the z direction and the records that their elevation is closer
+     * than #z_thres are merged into a single node.
+     * \param recs is the list of the records. It is sorted in place.
+     * \param conn_pairs is a list of (dof, connected dof) pairs. It is sorted in place and moved into the #conn.
+     * \param cnstr_pairs is a list of (dof, constraint dof) pairs.
+     * \param z_thres is the threshold along the z direction.
+     */
+    void build(std::vector<Znode_rec>& recs,
+               std::vector<std::pair<int,int> >& conn_pairs,
+               std::vector<std::pair<int,int> >& cnstr_pairs,
+               double z_thres);
+
+    /*!
+     * \brief patch updates the store after a refinement using the records of the new cell loop.
+     * Only the columns that have changed are rebuilt from their records. The other columns keep their
+     * nodes and their connections and only get the new dofs.
+     * A column is considered changed if it is flagged in the #dirty, if it has been added after the last build,
+     * or if its records do not match one to one its existing nodes.
+     * The input parameters are the same as in #build.
+     * \param dirty has one flag per column. On output it is true for the columns that have been rebuilt.
+     */
+    void patch(std::vector<Znode_rec>& recs,
+               std::vector<std::pair<int,int> >& conn_pairs,
+               std::vector<std::pair<int,int> >& cnstr_pairs,
+               std::vector<char>& dirty,
+               double z_thres);
+
+    /*!
+     * \brief sort_columns orders the columns along a Morton curve of their x-y location with bucket size #h, so that
+     * the columns that are close to each other, and their nodes, are also close in memory.
+     * The columns that have no nodes, because a #patch has removed all of them, are dropped.
+     * \param order On output order[new id] is the old id of each column. Its size is the new number of columns
+     * \return false if the columns were already in order and none was empty. Then nothing has changed
+     */
+    bool sort_columns(double h, std::vector<int>& order);
+
+    //! Returns the index of the node of column #col that its reference elevation is closer than #z_thres to #z_in
+    //! or -9 if there is no such node
+    int find_z(int col, double z_in, double z_thres) const;
+
+    //! Returns true if the #f flag of the node #i is set
+    bool has(int i, unsigned char f) const {return (flags[i] & f) != 0;}
+
+    //! Sets or unsets the #f flag of the node #i
+    void set(int i, unsigned char f, bool v){
+        if (v) flags[i] |= f;
+        else flags[i] &= static_cast<unsigned char>(~f);
+    }
+
+    //! Returns true if the #dof_in can be found in the list of connections of node #i
+    bool connected_with(int i, int dof_in) const;
+
+    //! The x coordinate of each column
+    std::vector<double> X;
+    //! The y coordinate of each column. In 2D this is always 0
+    std::vector<double> Y;
+    //! The offsets of each column in the per node arrays. The size is #n_columns + 1
+    std::vector<int> col_ptr;
+
+    //! The elevation of each node
+    std::vector<double> z;
+    //! The elevation of each node at the time the store was built or patched. The #z changes when the mesh moves
+    //! and this is used to match the nodes of the unchanged columns during #patch
+    std::vector<double> z_ref;
+    //! The relative position of each node with respect to the nodes above and below
+    std::vector<double> rel_pos;
+    //! The dof of each node
+    std::vector<int> dof;
+    //! The dof of the node above. If its -9 there is no node above
+    std::vector<int> dof_above;
+    //! The dof of the node below. If its -9 there is no node below
+    std::vector<int> dof_below;
+    //! The node that serves as top for each node
+    std::vector<DOFZ> Top;
+    //! The node that serves as bottom for each node
+    std::vector<DOFZ> Bot;
+    //! The packed #Zflag bits of each node
+    std::vector<unsigned char> flags;
+
+    //! The offsets of each node in the #cnstr array. The size is #n_nodes + 1
+    std::vector<int> cnstr_ptr;
+    //! The dofs of the nodes that constraint each hanging node
+    std::vector<int> cnstr;
+
+    //! A sorted list of (dof, connected dof) pairs
+    std::vector<std::pair<int,int> > conn;
+};
+
+Column_store::Column_store(){
+    clear();
+}
+
+void Column_store::clear(){
+    X.clear();
+    Y.clear();
+    col_ptr.assign(1, 0);
+    z.clear();
+    z_ref.clear();
+    rel_pos.clear();
+    dof.clear();
+    dof_above.clear();
+    dof_below.clear();
+    Top.clear();
+    Bot.clear();
+    flags.clear();
+    cnstr_ptr.assign(1, 0);
+    cnstr.clear();
+    conn.clear();
+}
+
+int Column_store::add_column(double x, double y){
+    X.push_back(x);
+    Y.push_back(y);
+    return static_cast<int>(X.size()) - 1;
+}
+
+void Column_store::build(std::vector<Znode_rec>& recs,
+                         std::vector<std::pair<int,int> >& conn_pairs,
+                         std::vector<std::pair<int,int> >& cnstr_pairs,
+                         double z_thres){
+    // A build is a patch where all columns have changed
+    col_ptr.assign(1, 0);
+    z.clear(); z_ref.clear(); dof.clear(); flags.clear(); rel_pos.clear();
+    std::vector<char> dirty(X.size(), 1);
+    patch(recs, conn_pairs, cnstr_pairs, dirty, z_thres);
+}
+
+void Column_store::patch(std::vector<Znode_rec>& recs,
+                         std::vector<std::pair<int,int> >& conn_pairs,
+                         std::vector<std::pair<int,int> >& cnstr_pairs,
+                         std::vector<char>& dirty,
+                         double z_thres){
+    const int Nold_col = static_cast<int>(col_ptr.size()) - 1;
+    const int Nold = n_nodes();
+    dirty.resize(X.size(), 1);
+    for (unsigned int c = Nold_col; c < dirty.size(); ++c)
+        dirty[c] = 1;
+
+    // Match the records of the unchanged columns with their existing nodes
+    std::vector<int> new_dof(Nold, -9);
+    std::vector<double> new_z(Nold, -9999);
+    std::vector<unsigned char> new_flags(Nold, 0);
+    for (unsigned int i = 0; i < recs.size(); ++i){
+        if (dirty[recs[i].col])
+            continue;
+        int k = find_z(recs[i].col, recs[i].z, z_thres);
+        if (k < 0){
+            dirty[recs[i].col] = 1;
+            continue;
+        }
+        new_dof[k] = recs[i].dof;
+        new_z[k] = recs[i].z;
+        new_flags[k] |= recs[i].flags;
+    }
+    // and if any of the existing nodes was not found again the column has changed
+    bool any_clean = false;
+    for (int c = 0; c < Nold_col; ++c){
+        if (dirty[c])
+            continue;
+        for (int k = col_ptr[c]; k < col_ptr[c+1]; ++k){
+            if (new_dof[k] < 0){
+                dirty[c] = 1;
+                break;
+            }
+        }
+        if (!dirty[c])
+            any_clean = true;
+    }
+
+    // Only the records of the changed columns have to be sorted
+    if (any_clean){
+        unsigned int n = 0;
+        for (unsigned int i = 0; i < recs.size(); ++i){
+            if (dirty[recs[i].col])
+                recs[n++] = recs[i];
+        }
+        recs.resize(n);
+    }
+    { // Bucket the records by column and then sort the elevations of each column in parallel
+        std::vector<int> ptr(X.size() + 1, 0);
+        for (unsigned int i = 0; i < recs.size(); ++i)
+            ptr[recs[i].col + 1]++;
+        for (unsigned int c = 0; c < X.size(); ++c)
+            ptr[c+1] += ptr[c];
+        std::vector<int> pos(ptr.begin(), ptr.end() - 1);
+        std::vector<Znode_rec> sorted(recs.size());
+        for (unsigned int i = 0; i < recs.size(); ++i)
+            sorted[pos[recs[i].col]++] = recs[i];
+        recs.swap(sorted);
+        dealii::parallel::apply_to_subranges(0, static_cast<int>(X.size()),
+                                             std::bind(&sort_Znode_columns, std::cref(ptr), std::ref(recs),
+                                                       std::placeholders::_1, std::placeholders::_2),
+                                             64);
+    }
+
+    std::vector<double> nz, nz_ref, nrel;
+    std::vector<int> ndof, ncol_ptr(X.size() + 1, 0);
+    std::vector<unsigned char> nflags;
+    nz.reserve(Nold + recs.size()/2); ndof.reserve(Nold + recs.size()/2); nflags.reserve(Nold + recs.size()/2);
+    nrel.reserve(Nold + recs.size()/2);
+
+    unsigned int ir = 0;
+    for (unsigned int c = 0; c < X.size(); ++c){
+        if (!dirty[c]){
+            // The column keeps its nodes and the way they are connected
+            for (int k = col_ptr[c]; k < col_ptr[c+1]; ++k){
+                nz.push_back(new_z[k]);
+                ndof.push_back(new_dof[k]);
+                nflags.push_back((flags[k] & (ZF_CONN_ABOVE | ZF_CONN_BELOW)) | new_flags[k]);
+                nrel.push_back(rel_pos[k]);
+            }
+        }else{
+            // The records of the same column are consecutive and sorted by z, so a node that
+            // has been found in more than one cell will be next to the previous one
+            for (unsigned int i0 = ir; ir < recs.size() && recs[ir].col == static_cast<int>(c); ++ir){
+                if (ir > i0 && std::abs(recs[ir].z - nz.back()) < z_thres){
+                    if (recs[ir].dof != ndof.back())
+                        std::cerr << " You attempt to update on a point that has already dof\n"
+                                  <<  "However the updated dof is different from the current dof" << std::endl;
+                    nflags.back() |= recs[ir].flags;
+                    continue;
+                }
+                nz.push_back(recs[ir].z);
+                ndof.push_back(recs[ir].dof);
+                nflags.push_back(recs[ir].flags);
+                nrel.push_back(-9.0);
+            }
+        }
+        ncol_ptr[c+1] = static_cast<int>(nz.size());
+    }
+
+    nz_ref = nz;
+    z.swap(nz);
+    z_ref.swap(nz_ref);
+    dof.swap(ndof);
+    flags.swap(nflags);
+    rel_pos.swap(nrel);
+    col_ptr.swap(ncol_ptr);
+
+    const unsigned int Nnodes = z.size();
+    DOFZ dummy;
+    dummy.dummy_values();
+    dof_above.assign(Nnodes, -9);
+    dof_below.assign(Nnodes, -9);
+    Top.assign(Nnodes, dummy);
+    Bot.assign(Nnodes, dummy);
+
+    // The constraints of a dof are the same in every cell. Copy them to the node in one pass
+    std::sort(cnstr_pairs.begin(), cnstr_pairs.end());
+    cnstr_pairs.erase(std::unique(cnstr_pairs.begin(), cnstr_pairs.end()), cnstr_pairs.end());
+    cnstr_ptr.assign(Nnodes + 1, 0);
+    cnstr.clear();
+    for (unsigned int i = 0; i < Nnodes; ++i){
+        std::vector<std::pair<int,int> >::iterator it = std::lower_bound(cnstr_pairs.begin(), cnstr_pairs.end(),
+                                                                         std::pair<int,int>(dof[i], -2147483647));
+        for (; it != cnstr_pairs.end() && it->first == dof[i]; ++it){
+            if (it->second != dof[i])
+                cnstr.push_back(it->second);
+        }
+        cnstr_ptr[i+1] = static_cast<int>(cnstr.size());
+        set(i, ZF_HANGING, cnstr_ptr[i+1] > cnstr_ptr[i]);
+    }
+
+    // The connections are needed only for the columns that have been rebuilt
+    if (any_clean){
+        std::vector<int> dirty_dofs;
+        for (unsigned int i = 0; i < recs.size(); ++i)
+            dirty_dofs.push_back(recs[i].dof);
+        std::sort(dirty_dofs.begin(), dirty_dofs.end());
+        unsigned int n = 0;
+        for (unsigned int i = 0; i < conn_pairs.size(); ++i){
+            if (std::binary_search(dirty_dofs.begin(), dirty_dofs.end(), conn_pairs[i].first))
+                conn_pairs[n++] = conn_pairs[i];
+        }
+        conn_pairs.resize(n);
+    }
+    std::sort(conn_pairs.begin(), conn_pairs.end());
+    conn_pairs.erase(std::unique(conn_pairs.begin(), conn_pairs.end()), conn_pairs.end());
+    conn.swap(conn_pairs);
+    conn_pairs.clear();
+    recs.clear();
+}
+
+//! Reorders #v so that the new element i is the old element #order[i]
+template <typename T>
+void permute_vector(std::vector<T>& v, const std::vector<int>& order){
+    std::vector<T> tmp(order.size());
+    for (unsigned int i = 0; i < order.size(); ++i)
+        tmp[i] = v[order[i]];
+    v.swap(tmp);
+}
+
+bool Column_store::sort_columns(double h, std::vector<int>& order){
+    const int Ncol = n_columns();
+    order.resize(Ncol);
+    if (Ncol == 0)
+        return false;
+    const double x0 = *std::min_element(X.begin(), X.end());
+    const double y0 = *std::min_element(Y.begin(), Y.end());
+    std::vector<std::pair<unsigned long long, int> > keys;
+    keys.reserve(Ncol);
+    for (int c = 0; c < Ncol; ++c){
+        if (col_ptr[c+1] > col_ptr[c])
+            keys.push_back(std::pair<unsigned long long, int>(xy_morton_key(X[c], Y[c], x0, y0, h), c));
+    }
+    std::sort(keys.begin(), keys.end());
+    const int Nnew_col = static_cast<int>(keys.size());
+    order.resize(Nnew_col);
+    bool changed = Nnew_col != Ncol;
+    for (int c = 0; c < Nnew_col; ++c){
+        order[c] = keys[c].second;
+        if (order[c] != c)
+            changed = true;
+    }
+    if (!changed)
+        return false;
+
+    // The nodes of the new columns in the new order and the new offsets
+    std::vector<int> node_order;
+    node_order.reserve(n_nodes());
+    std::vector<int> ncol_ptr(Nnew_col + 1, 0);
+    for (int c = 0; c < Nnew_col; ++c){
+        for (int k = col_ptr[order[c]]; k < col_ptr[order[c]+1]; ++k)
+            node_order.push_back(k);
+        ncol_ptr[c+1] = static_cast<int>(node_order.size());
+    }
+
+    std::vector<int> ncnstr_ptr(node_order.size() + 1, 0);
+    std::vector<int> ncnstr;
+    ncnstr.reserve(cnstr.size());
+    for (unsigned int i = 0; i < node_order.size(); ++i){
+        for (int k = cnstr_ptr[node_order[i]]; k < cnstr_ptr[node_order[i]+1]; ++k)
+            ncnstr.push_back(cnstr[k]);
+        ncnstr_ptr[i+1] = static_cast<int>(ncnstr.size());
+    }
+
+    permute_vector(X, order);
+    permute_vector(Y, order);
+    col_ptr.swap(ncol_ptr);
+    permute_vector(z, node_order);
+    permute_vector(z_ref, node_order);
+    permute_vector(rel_pos, node_order);
+    permute_vector(dof, node_order);
+    permute_vector(dof_above, node_order);
+    permute_vector(dof_below, node_order);
+    permute_vector(Top, node_order);
+    permute_vector(Bot, node_order);
+    permute_vector(flags, node_order);
+    cnstr_ptr.swap(ncnstr_ptr);
+    cnstr.swap(ncnstr);
+    return true;
+}
+
+bool Column_store::has_empty_columns() const{
+    for (int c = 0; c < n_columns(); ++c){
+        if (col_ptr[c+1] == col_ptr[c])
+            return true;
+    }
+    return false;
+}
+
+int Column_store::find_z(int col, double z_in, double z_thres) const{
+    std::vector<double>::const_iterator first = z_ref.begin() + col_ptr[col];
+    std::vector<double>::const_iterator last = z_ref.begin() + col_ptr[col+1];
+    std::vector<double>::const_iterator it = std::lower_bound(first, last, z_in - z_thres);
+    if (it != last && std::abs(*it - z_in) < z_thres)
+        return static_cast<int>(it - z_ref.begin());
+    return -9;
+}
+
+bool Column_store::connected_with(int i, int dof_in) const{
+    return std::binary_search(conn.begin(), conn.end(), std::pair<int,int>(dof[i], dof_in));
+}
+
+#endif // COLUMN_STORE_H
@@ -0,0 +1,123 @@
+#ifndef DOF_LOOKUP_H
+#define DOF_LOOKUP_H
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include <deal.II/base/index_set.h>
+
+using namespace dealii;
+
+/*!
+ * \brief The Dof_lookup class relates the dofs with the node indices of the #Column_store.
+ *
+ * The locally owned dofs are contiguous, therefore their node indices are stored in a dense array which is indexed
+ * directly by the dof minus the first owned dof. The ghost dofs are kept in a sorted array next to their node indices.
+ * The few dofs that may be found in the structure but are not locally relevant are kept in a hash map.
+ */
+class Dof_lookup{
+public:
+    Dof_lookup();
+
+    //! Deletes all the entries and sets the locally owned and the locally relevant dofs that will be stored in the arrays
+    void reinit(const IndexSet& locally_owned, const IndexSet& locally_relevant);
+
+    //! Deletes everything
+    void clear();
+
+    //! Associates the #dof with the node index #id
+    void set(int dof, int id);
+
+    //! Returns the node index of the #dof or -9 if the dof does not exist in the structure
+    int find(int dof) const;
+
+private:
+    //! The first locally owned dof
+    int owned_begin;
+    //! One past the last locally owned dof
+    int owned_end;
+
+    //! The node index of each locally owned dof. -9 if the dof is not in the structure
+    std::vector<int> owned_id;
+
+    //! The sorted dofs that are locally relevant but not locally owned
+    std::vector<int> ghost_dof;
+    //! The node index of each dof of #ghost_dof. -9 if the dof is not in the structure
+    std::vector<int> ghost_id;
+
+    //! The node index of the dofs that are not locally relevant
+    std::unordered_map<int,int> other;
+
+    //! Returns the position of the #dof in the #ghost_dof or -9
+    int ghost_position(int dof) const;
+};
+
+Dof_lookup::Dof_lookup(){
+    clear();
+}
+
+void Dof_lookup::reinit(const IndexSet& locally_owned, const IndexSet& locally_relevant){
+    owned_begin = 0;
+    owned_end = 0;
+    if (locally_owned.n_elements() > 0){
+        owned_begin = static_cast<int>(locally_owned.nth_index_in_set(0));
+        owned_end = owned_begin + static_cast<int>(locally_owned.n_elements());
+    }
+    owned_id.assign(owned_end - owned_begin, -9);
+
+    ghost_dof.clear();
+    for (IndexSet::ElementIterator it = locally_relevant.begin(); it != locally_relevant.end(); ++it){
+        const int dof = static_cast<int>(*it);
+        if (dof < owned_begin || dof >= owned_end)
+            ghost_dof.push_back(dof);
+    }
+    ghost_id.assign(ghost_dof.size(), -9);
+    other.clear();
+}
+
+void Dof_lookup::clear(){
+    owned_begin = 0;
+    owned_end = 0;
+    owned_id.clear();
+    ghost_dof.clear();
+    ghost_id.clear();
+    other.clear();
+}
+
+int Dof_lookup::ghost_position(int dof) const{
+    std::vector<int>::const_iterator it = std::lower_bound(ghost_dof.begin(), ghost_dof.end(), dof);
+    if (it != ghost_dof.end() && *it == dof)
+        return static_cast<int>(it - ghost_dof.begin());
+    return -9;
+}
+
+void Dof_lookup::set(int dof, int id){
+    if (dof < 0)
+        return;
+    if (dof >= owned_begin && dof < owned_end){
+        owned_id[dof - owned_begin] = id;
+        return;
+    }
+    int ig = ghost_position(dof);
+    if (ig >= 0)
+        ghost_id[ig] = id;
+    else
+        other[dof] = id;
+}
+
+int Dof_lookup::find(int dof) const{
+    if (dof < 0)
+        return -9;
+    if (dof >= owned_begin && dof < owned_end)
+        return owned_id[dof - owned_begin];
+    int ig = ghost_position(dof);
+    if (ig >= 0)
+        return ghost_id[ig];
+    std::unordered_map<int,int>::const_iterator it = other.find(dof);
+    if (it != other.end())
+        return it->second;
+    return -9;
+}
+
+#endif // DOF_LOOKUP_H
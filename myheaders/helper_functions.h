@@ -186,37 +186,26 @@ void create_outline_polygon(std::vector<std::vector<Point<dim-1>>> &pointdata, M
     //std::cout << "Rank: " << my_rank << " outline has " << pointdata[my_rank].size() << " points" << std::endl;
 
     // Send my polygon outline to all processors
-    std::vector<std::vector<double> > serialized_points(n_proc);
+    std::vector<double> serialized_points;
     for (unsigned int i = 0; i < pointdata[my_rank].size(); ++ i){
-        serialized_points[my_rank].push_back(pointdata[my_rank][i][0]);
+        serialized_points.push_back(pointdata[my_rank][i][0]);
         if (dim == 3)
-            serialized_points[my_rank].push_back(pointdata[my_rank][i][1]);
+            serialized_points.push_back(pointdata[my_rank][i][1]);
     }
 
-    //std::cout << "I'm " << my_rank << " and have " << serialized_points[my_rank].size() << " serialized points" << std::endl;
 
-    std::vector <int> Npoints_per_polygon_proc(n_proc);
-    Send_receive_size(static_cast<unsigned int>(serialized_points[my_rank].size()), n_proc, Npoints_per_polygon_proc, mpi_communicator);
-    //for (int i = 0; i < n_proc; ++i)
-    //    std::cout << "I'm " << my_rank << " and proc " << i << " has " << Npoints_per_polygon_proc[i] << " points" << std::endl;
-
-
-    Sent_receive_data<double>(serialized_points, Npoints_per_polygon_proc, my_rank, mpi_communicator, MPI_DOUBLE);
-    //if (my_rank == 3){
-    //    for (int i = 0; i < n_proc; ++i){
-    //        std::cout << i << " : " << serialized_points[i][0] << ", " << serialized_points[i][1] << std::endl;
-    //    }
-    //}
+    Gather_view<double> outlines;
+    All_gather_data<double>(serialized_points, outlines, mpi_communicator, MPI_DOUBLE);
 
     // gather data from the other processors
     for (unsigned int i = 0; i < n_proc; ++i){
         if (i == my_rank)
             continue;
-        for (int j = 0; j < Npoints_per_polygon_proc[i];){
+        for (const double* p = outlines.begin(i); p != outlines.end(i);){
             Point<dim-1> tempP;
-            tempP[0] = serialized_points[i][j]; j++;
+            tempP[0] = *p; p++;
             if (dim == 3){
-                tempP[1] = serialized_points[i][j]; j++;
+                tempP[1] = *p; p++;
             }
             pointdata[i].push_back(tempP);
         }
@@ -326,7 +315,6 @@ double fRand(double fMin, double fMax)
 template <int dim>
 void RBF<dim>::assign_weights(MPI_Comm  mpi_communicator){
     unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
-    MPI_Barrier(mpi_communicator);
     if (my_rank == 0){
         weights.clear();
         for (unsigned int i = 0; i < centers.size(); ++i){
@@ -336,9 +324,8 @@ void RBF<dim>::assign_weights(MPI_Comm  mpi_communicator){
         weights.clear();
         weights.resize(centers.size());
     }
-    MPI_Barrier(mpi_communicator);
+    // The broadcast is all the synchronization that is needed
     MPI_Bcast(&weights[0], static_cast<int>(centers.size()),MPI_DOUBLE,0,mpi_communicator);
-    MPI_Barrier(mpi_communicator);
     //std::cout << "I'm rank " << my_rank << " with " << weights.size() << " weights" << std::endl;
     //for (int i = 0; i < weights.size(); ++i){
     //    std::cout << "rank" << my_rank << ", w" << i << "=" << weights[i] << std::endl;
@@ -8,14 +8,24 @@
 #include <deal.II/fe/mapping_q1.h>
 #include <deal.II/lac/constraint_matrix.h>
 #include <deal.II/lac/trilinos_vector.h>
+#include <deal.II/lac/trilinos_sparse_matrix.h>
+#include <deal.II/lac/dynamic_sparsity_pattern.h>
 #include <deal.II/distributed/tria.h>
 #include <deal.II/distributed/solution_transfer.h>
 #include <deal.II/base/conditional_ostream.h>
+#include <deal.II/base/work_stream.h>
+#include <deal.II/base/parallel.h>
 
 #include <algorithm>
+#include <set>
+#include <functional>
+#include <limits>
+#include <cmath>
 
 #include "zinfo.h"
 #include "pnt_info.h"
+#include "dof_lookup.h"
+#include "xy_hash.h"
 #include "cgal_functions.h"
 #include "my_functions.h"
 #include "mpi_help.h"
@@ -36,17 +46,123 @@ struct trianode {
     std::vector<types::global_dof_index> cnstr_nd;
 };
 
-struct new_DOFZ{
-    new_DOFZ(){
-        new_dof = -9;
-        proc = -9;
-        z = -9999.0;
-    }
-    int new_dof;
-    int proc;
+//! A locally owned mesh dof with the location of its vertex. See #Mesh_struct::renumber_columns
+struct Dof_order_rec{
+    //! The Morton key of the x-y location
+    unsigned long long xy;
     double z;
+    unsigned int component;
+    types::global_dof_index dof;
+};
+
+//! Sort the dofs by column, then from the bottom to the top and then by component
+inline bool sort_Dof_order_rec(const Dof_order_rec& A, const Dof_order_rec& B){
+    if (A.xy != B.xy)
+        return A.xy < B.xy;
+    if (A.z != B.z)
+        return A.z < B.z;
+    return A.component < B.component;
+}
+
+//! One round of a recorded exchange of elevations. See #Mesh_struct::resolve_elevations
+struct Elev_round{
+    //! The processors that this one sends to, and for each one the local nodes whose elevation is sent
+    std::vector<int> send_procs;
+    std::vector<std::vector<int> > send_nodes;
+    std::vector<std::vector<double> > send_z;
+    //! The processors that this one receives from, and for each one the dofs whose elevation is received
+    std::vector<int> recv_procs;
+    std::vector<std::vector<int> > recv_dofs;
+    std::vector<std::vector<double> > recv_z;
+    //! The persistent requests of the sends followed by the receives
+    std::vector<MPI_Request> requests;
+};
+
+//! The state of one round of the asynchronous elevation exchange of #Mesh_struct::resolve_elevations
+struct Elev_exchange{
+    Elev_exchange(MPI_Comm comm, int tag, int my_rank_in, int n_proc_in, bool ask_all_in)
+        :
+          exchange(comm, tag),
+          my_rank(my_rank_in),
+          n_proc(n_proc_in),
+          ask_all(ask_all_in),
+          n_received(0)
+    {}
+    Async_exchange exchange;
+    int my_rank;
+    int n_proc;
+    //! If true the dofs with unknown owner are asked from all processors instead of the neighbors
+    bool ask_all;
+    //! The requests of the other processors for local nodes that are not set yet as (processor, dof)
+    std::vector<std::pair<int,int> > pending;
+    //! The number of elevations received in this round
+    int n_received;
+    //! The (dof, elevation) received in this round. They are used only after the local pass of the round is complete,
+    //! so that what a round sends and receives depends only on the previous rounds. See #Mesh_struct::elev_plan
+    std::vector<std::pair<int, double> > received;
+    //! The local nodes sent to and the dofs received from each processor. They are recorded in the #Mesh_struct::elev_plan
+    std::map<int, std::vector<int> > sent_nodes;
+    std::map<int, std::vector<int> > received_dofs;
+};
+
+//! The per thread data of the cell loop of #Mesh_struct::updateMeshStruct
+template <int dim>
+struct Sweep_scratch{
+    Sweep_scratch(const Mapping<dim>& mapping,
+                  const FiniteElement<dim>& fe,
+                  const Quadrature<dim>& quadrature)
+        :
+          fe_mesh_points(mapping, fe, quadrature, update_quadrature_points),
+          cell_dof_indices(fe.dofs_per_cell)
+    {}
+
+    Sweep_scratch(const Sweep_scratch& other)
+        :
+          fe_mesh_points(other.fe_mesh_points.get_mapping(),
+                         other.fe_mesh_points.get_fe(),
+                         other.fe_mesh_points.get_quadrature(),
+                         other.fe_mesh_points.get_update_flags()),
+          cell_dof_indices(other.cell_dof_indices.size())
+    {}
+
+    FEValues<dim> fe_mesh_points;
+    std::vector<unsigned int> cell_dof_indices;
+};
+
+//! The information of one cell that the cell loop of #Mesh_struct::updateMeshStruct gathers in parallel
+//! and then merges serially into the structure
+template <int dim>
+struct Sweep_copy{
+    //! The subdomain of a ghost cell or -9
+    int ghost_subdomain;
+    //! The x-y location of each record in #recs
+    std::vector<Point<dim-1> > pnts;
+    std::vector<Znode_rec> recs;
+    //! The triangulation vertex of each record in #recs
+    std::vector<unsigned int> vertices;
+    std::vector<std::pair<int,int> > conn_pairs;
+    std::vector<std::pair<int,int> > cnstr_pairs;
+    //! The end of the constraint pairs of each record in #cnstr_pairs
+    std::vector<unsigned int> cnstr_end;
+    //! The (dof, coordinate) values for the #distributed_mesh_vertices
+    std::vector<std::pair<unsigned int, double> > vertex_values;
 };
 
+/*!
+ * \brief vertex_component returns the component of the mesh finite element that holds the coordinate #dir of the vertices
+ * or -1 if this coordinate is not stored.
+ * The mesh vertices are stored either as a #dim component field or, in the z only mode, as a single component field
+ * that holds only the vertical coordinate. In the latter case the x-y coordinates are taken from the triangulation.
+ */
+template <int dim>
+int vertex_component(const FiniteElement<dim>& fe, unsigned int dir){
+    if (fe.n_components() == dim)
+        return static_cast<int>(dir);
+    if (dir == dim-1)
+        return 0;
+    return -1;
+}
+
 //! Returns true if any neighbor element is ghost
 template <int dim>
 bool any_ghost_neighbor(typename DoFHandler<dim>::active_cell_iterator cell){
@@ -91,35 +207,132 @@ public:
      */
     Mesh_struct(double xy_thr, double z_thr);
 
+    //! Frees the persistent requests of the exchange plan
+    ~Mesh_struct();
+
     //! The threshold along the x-y coordinates
     double xy_thres;
     //! The threshold along the z coordinates
     double z_thres;
 
-    //! This is a counter for the points in the #PointsMap
-    int _counter;
-
-    //! This map associates each point with a unique id (#_counter)
-    std::map<int , PntsInfo<dim> > PointsMap;
+    //! The x-y columns of the mesh. Each column holds the z nodes with the same x-y coordinates.
+    //! Use #PntsInfo and #Zinfo to access a column or a node.
+    Column_store Columns;
 
-    //! This is a Map structure that relates the dofs with the PointsMap.
-    //! The key is the dof and the value is the pair #PointsMap key and the index of the z value in
-    //! the Zlist of the #PointsMap.
-    //! In other words <dof> - <xy_index, z_index>
-    std::map<int,std::pair<int,int> > dof_ij;
+    //! This is a lookup table that relates the dofs with the #Columns.
+    //! For a given dof it returns the index of the node in the per node arrays of the #Columns
+    //! or -9 if the dof is not in the structure.
+    //! In other words <dof> - <z node index>
+    Dof_lookup dof_ij;
 
-    //! this is a cgal container of the points of this class stored in an optimized way for spatial queries
+    //! this is a cgal container of the points of this class stored in an optimized way for spatial queries.
+    //! It is built in bulk by #build_CGALset once all the columns are known.
     PointSet2 CGALset;
 
-    //! Adds a new point in the structure. If the point exists adds the z coordinate only and returns
-    //! the id of the existing point. if the point doesnt exist creates a new point and returns the new id.
-    void add_new_point(Point<dim-1>, Zinfo zinfo);
+    //! A spatial hash of the x-y locations of the #Columns. This is used to find if a point already exists
+    //! while the structure is being built.
+    XY_hash xy_index;
+
+    //! If this is true the #updateMeshStruct keeps the existing columns and rebuilds only the ones that
+    //! have changed since the last update. The changed columns are flagged by #flag_changed_columns
+    //! and by #Column_store::patch. The default is false
+    bool incremental_update;
+
+    /*!
+     * \brief flag_changed_columns marks the columns that will be affected by the next refinement.
+     * These are the columns of the vertices of the locally owned cells that are flagged for refinement or coarsening
+     * and of their finer neighbors. This should be called after Triangulation::prepare_coarsening_and_refinement
+     * and before the refinement is executed.
+     * Changes that this processor cannot see, e.g. in the ghost cells, are detected later by #Column_store::patch
+     */
+    void flag_changed_columns(parallel::distributed::Triangulation<dim>& triangulation);
+
+    /*!
+     * \brief track_topology connects the structure to the refinement signals of the #triangulation.
+     * After this the #updateMeshStruct rebuilds the structure only if cells have been refined, coarsened
+     * or changed owner since the last build. Otherwise it only prepares the structure for the next elevation update.
+     */
+    void track_topology(parallel::distributed::Triangulation<dim>& triangulation);
+
+    /*!
+     * \brief align_columns connects the structure to the cell weight signal of the #triangulation so that the
+     * partitioning keeps each coarse cell, and everything refined from it, on one processor.
+     * If each coarse cell spans the whole depth of the domain (one coarse layer in the vertical direction) then
+     * the whole x-y column is on one processor. The Top/Bot of the nodes are then always local and
+     * only the lateral ghost columns have to be exchanged.
+     * The triangulation should be created with the no_automatic_repartitioning setting and
+     * repartition() should be called after each refinement, so that all cells are weighted as persisting cells.
+     *
+     * This is best effort. p4est cuts the space filling curve by the weights and nothing forces a cut between two
+     * coarse cells, so a column may still be split. Use #columns_on_one_processor after the repartition to check it.
+     * Nothing in the structure assumes whole columns. A split column is merged by the Top/Bot exchange as in any partition.
+     */
+    void align_columns(parallel::distributed::Triangulation<dim>& triangulation);
+
+    //! Returns true on all processors if every coarse cell has all its active cells on one processor.
+    //! With #align_columns and one coarse layer in the vertical direction this means that no x-y column is split
+    bool columns_on_one_processor(const parallel::distributed::Triangulation<dim>& triangulation,
+                                  MPI_Comm& mpi_communicator);
+
+    /*!
+     * \brief cost_weights connects the structure to the cell weight signal of the #triangulation so that the
+     * partitioning balances the work of the structure instead of the number of cells.
+     * The cost of a cell is the sum over its vertices of the depth of the vertex column plus the number
+     * of hanging nodes in that column, as they were found in the last #updateMeshStruct.
+     * Use it with the no_automatic_repartitioning setting and call repartition() when #is_imbalanced is true.
+     */
+    void cost_weights(parallel::distributed::Triangulation<dim>& triangulation);
+
+    /*!
+     * \brief renumber_columns renumbers the locally owned dofs of the #mesh_dof_handler column by column.
+     * The columns are ordered along a Morton curve of their x-y location and the dofs of each column from the
+     * bottom to the top, with the components of a vertex next to each other. The dofs stay in the locally owned range.
+     * #updateMeshStruct calls it after distributing the dofs. Call it also after any other distribute_dofs
+     * of the #mesh_dof_handler so that the numbering is the same.
+     */
+    void renumber_columns(DoFHandler<dim>& mesh_dof_handler);
+
+    //! The ratio between the maximum and the average time of the local work of #updateMeshStruct
+    //! above which the processors are considered imbalanced. Default is 1.2
+    double imbalance_threshold;
+
+    //! Returns true on all processors if the time of the local work in the last #updateMeshStruct
+    //! was imbalanced more than #imbalance_threshold
+    bool is_imbalanced(MPI_Comm& mpi_communicator, ConditionalOStream pcout);
+
+    //! If this is true (default) the #updateMeshElevation moves the vertices of the triangulation to the new elevations.
+    //! If it is false the triangulation stays in reference coordinates and the new elevations are only
+    //! written to the vertex vectors. Use #compute_displacement to describe the deformed mesh with a
+    //! displacement field, e.g. through a MappingQEulerian. In that case the refinement does not need to undo
+    //! the displacements.
+    bool move_triangulation;
+
+    /*!
+     * \brief compute_displacement sets the displacement of the locally owned vertex dofs, which is the difference
+     * between the #mesh_vertices and the reference vertex coordinates of the triangulation.
+     * To be used with a MappingQEulerian the mesh finite element must have #dim components.
+     */
+    void compute_displacement(DoFHandler<dim>& mesh_dof_handler,
+                              const TrilinosWrappers::MPI::Vector& mesh_vertices,
+                              TrilinosWrappers::MPI::Vector& distributed_displacement);
+
+    //! If this is true the #updateMeshElevation computes the elevations with a single multiplication
+    //! of the #elevation_operator with the top and bottom elevations instead of resolving them iteratively.
+    //! The default is false
+    bool use_elevation_operator;
+
+    //! Adds a new point in the structure. If the point exists adds the z record to the existing column
+    //! otherwise creates a new column. The z records are merged into nodes later by #Column_store::build.
+    void add_new_point(Point<dim-1>, Znode_rec zrec);
 
     //! Checks if the point already exists in the mesh structure
-    //! If the point exists it returns the id of the point in the #CGALset
+    //! If the point exists it returns the id of the column in the #Columns
     //! otherwise returns -9;
     int check_if_point_exists(Point<dim-1> p);
 
+    //! Inserts all the columns into the #CGALset in one go
+    void build_CGALset();
+
     /*!
      * \brief updateMeshstruct is the heart of this class. For a given parallel triangulation updates the existing
      * points or creates new ones.
@@ -179,6 +392,9 @@ public:
     //! resets all the information that is contained except the coordinates and the level of the points
     void reset();
 
+    //! resets only the dof related information and keeps the columns for an incremental update
+    void reset_dofs();
+
     //! Prints to screen the number of vertices the #myrank processor has.
     //! It is used primarily for debuging
     void n_vertices(int myrank);
@@ -189,14 +405,8 @@ public:
     //! (MAYBE THIS SHOULD SET THE DOF of the top/bottom node and not the elevation
     void set_id_above_below(int my_rank);
 
-    //! This creates the #dof_ij map.
-    void make_dof_ij_map();
-
-    //! This method calculates the top and bottom elevation on the points of the #PointsMap
-    //! This should be called on the initial grid before any refinement
-    void compute_initial_elevations(MyFunction<dim, dim-1> top_function,
-                                    MyFunction<dim, dim-1> bot_function,
-                                    std::vector<double>& vert_discr);
+    //! This creates the #dof_ij lookup table in one pass over the nodes.
+    void make_dof_ij_map(const IndexSet& mesh_locally_owned, const IndexSet& mesh_locally_relevant);
 
     //! This method sets the scales #dbg_scale_x and #dbg_scale_z for debug plotting using softwares like houdini
     void dbg_set_scales(double xscale, double zscale);
@@ -207,15 +417,235 @@ public:
                        unsigned int my_rank,
                        std::string prefix);
 
-    void printMesh(std::string filename, unsigned int i_proc, DoFHandler<dim>& mesh_dof_handler);
+    //! Prints the locally owned cells. If a #mapping is given the vertices are mapped with it, which is needed
+    //! when the triangulation is not moved (see #move_triangulation)
+    void printMesh(std::string filename, unsigned int i_proc, DoFHandler<dim>& mesh_dof_handler,
+                   const Mapping<dim>* mapping = NULL);
 private:
     void dbg_meshStructInfo2D(std::string filename, unsigned int n_proc);
     void dbg_meshStructInfo3D(std::string filename, unsigned int n_proc);
     double dbg_scale_x;
     double dbg_scale_z;
 
-    void identify_local_connections();
-    void identify_dependencies();
+    /*!
+     * \brief identify_dependencies returns the local nodes that their elevation is not set yet in dependency order.
+     * A node depends on its Top and Bot nodes or, if it is hanging, on the nodes that constraint it.
+     * Only the dependencies on local nodes are considered. The nodes that are part of a dependency cycle are
+     * appended at the end.
+     * The #level of each node in the #order is the length of the longest chain of local dependencies that leads to it.
+     * The nodes of the same level do not depend on each other, therefore they can be computed concurrently.
+     * Each node of a cycle gets a level of its own.
+     */
+    void identify_dependencies(std::vector<int>& order, std::vector<int>& level);
+
+    /*!
+     * \brief resolve_nodes computes the elevations of the nodes #worklist[#begin, #end) if everything they depend on is known.
+     * It runs concurrently on nodes of the same level and writes only the nodes in its range.
+     * \param elev_asked are the elevations that have been received from other processors
+     * \param asks are two (dof, owner processor) slots per worklist entry for the elevations that are missing
+     * \param done is set to 1 for the nodes that got their elevation now
+     */
+    void resolve_nodes(const std::vector<int>& worklist, unsigned int begin, unsigned int end,
+                       const std::map<int, double>& elev_asked, int my_rank,
+                       std::vector<std::pair<int,int> >& asks,
+                       std::vector<char>& done);
+
+    /*!
+     * \brief resolve_local_pass computes the elevations of the #worklist nodes in the order of their #level.
+     * The nodes that are still unknown remain in the #worklist and the remote elevations they miss are added to
+     * the #dof_ask_map as (dof, owner processor or -9).
+     * The number of nodes set is added to #progress and the number of nodes that are still unknown is returned.
+     * If #ex is given the missing elevations are asked after each level and the exchange progresses between the levels.
+     * The elevations that arrive during the pass are not used by it. They are added to #elev_asked by #finish_exchange
+     */
+    int resolve_local_pass(std::vector<int>& worklist, std::vector<int>& level,
+                           std::map<int, double>& elev_asked, int my_rank,
+                           std::map<int,int>& dof_ask_map, int& progress,
+                           Elev_exchange* ex = NULL);
+
+    /*!
+     * \brief progress_exchange sends the requests for the #new_asks, keeps the elevations that have been received in the
+     * Elev_exchange::received and answers the requests of the other processors for the local nodes that are set.
+     * The requests for nodes that are not set yet are kept for later, unless #final is true. Then they are dropped and
+     * the processor that asked will ask again in the next round.
+     */
+    void progress_exchange(Elev_exchange& ex, std::map<int,int>& new_asks, bool final);
+
+    //! Answers the remaining requests, completes the exchange of the round and adds the received elevations to #elev_asked
+    void finish_exchange(Elev_exchange& ex, std::map<int, double>& elev_asked);
+
+    /*!
+     * \brief The elevation exchange plan.
+     * While the structure does not change, the elevations that each processor needs from the others are the same at every
+     * time step. The rounds of the first #resolve_elevations after a rebuild are recorded, and the next calls
+     * execute them with persistent requests instead of discovering the owners again.
+     * A recorded round uses only the elevations received in the previous rounds, therefore the replay, which resolves
+     * the local nodes and then exchanges, sets the same nodes in the same round as the recording.
+     */
+    std::vector<Elev_round> elev_plan;
+
+    //! True if the #elev_plan can be executed
+    bool elev_plan_valid;
+
+    //! Creates the persistent requests of the #elev_plan
+    void init_elev_plan(MPI_Comm& mpi_communicator);
+
+    //! Frees the persistent requests and deletes the #elev_plan
+    void free_elev_plan();
+
+    //! Executes the rounds of the #elev_plan. Each round resolves the local nodes and then sends the elevations
+    //! that the other processors need. The received elevations are added to #elev_asked.
+    void execute_elev_plan(std::vector<int>& worklist, std::vector<int>& level,
+                           std::map<int, double>& elev_asked, int my_rank);
+
+    //! Copies the elevations of the nodes [#begin, #end) into the locally owned entries #vertices and their change
+    //! into #offsets. Both arrays start at the dof #first and end before #last.
+    void copy_elevations(int begin, int end, double* vertices, double* offsets,
+                         unsigned int first, unsigned int last) const;
+
+    //! Computes the new elevations of the local nodes by resolving the dependencies between the nodes and
+    //! communicating the missing elevations with the other processors until all nodes are set.
+    //! Returns false if the elevations were not resolved within 20 rounds
+    bool resolve_elevations(MPI_Comm& mpi_communicator, ConditionalOStream pcout);
+
+    /*!
+     * \brief assemble_elevation_operator creates the #elevation_operator. This follows the same dependencies as
+     * #resolve_elevations but instead of elevations each node carries a row of weights
+     * with respect to the top and bottom nodes. The relative positions and the hanging node averages are folded into
+     * the weights, therefore the relative positions at the time of the assembly are used until the next #updateMeshStruct.
+     * Returns false if the rows were not resolved within 20 rounds
+     */
+    bool assemble_elevation_operator(DoFHandler<dim>& mesh_dof_handler,
+                                     MPI_Comm& mpi_communicator,
+                                     ConditionalOStream pcout);
+
+    //! Sets the elevations of the local nodes as the product of the #elevation_operator with the elevations
+    //! of the top and bottom nodes. The operator is assembled first if it is not valid.
+    //! Returns false if the elevations could not be computed
+    bool apply_elevation_operator(DoFHandler<dim>& mesh_dof_handler,
+                                  MPI_Comm& mpi_communicator,
+                                  ConditionalOStream pcout);
+
+    //! Finds the row of weights for the #dof. It is either a local node with known row or a row that has been
+    //! received from another processor. Returns NULL if the row is not known yet
+    const std::map<int,double>* find_elevation_row(int dof,
+                                                   const std::vector<std::map<int,double> >& rows,
+                                                   const std::vector<char>& known,
+                                                   const std::map<int, std::map<int,double> >& rows_asked);
+
+    //! A matrix of size (number of mesh dofs)^2. The row of each locally owned vertical dof contains the weights
+    //! of the top and bottom nodes that its elevation depends on.
+    TrilinosWrappers::SparseMatrix elevation_operator;
+
+    //! This is false when the #elevation_operator has to be assembled again. It is set to false by #updateMeshStruct
+    bool elevation_operator_valid;
+
+    //! Increases every time a cell of the triangulation is refined or coarsened. See #track_topology
+    unsigned int topology_version;
+    //! The #topology_version at the time of the last build. It is -1 if there was no build since
+    //! #track_topology and -9 if the topology is not tracked
+    int built_topology_version;
+    //! A checksum of the locally owned and ghost cells at the last build. This catches the changes of cell
+    //! ownership that do not emit refinement signals
+    unsigned long long built_cell_checksum;
+
+    //! Called by the triangulation signals when a cell changes
+    void topology_changed();
+
+    /*!
+     * \brief column_cell_weight returns the weight of the #cell for the partitioning. The whole weight of a coarse cell
+     * is put on its last cell in the space filling curve, so that the partition boundaries fall between coarse cells.
+     * The weight is proportional to the number of active cells of the coarse cell, therefore the load stays balanced.
+     */
+    unsigned int column_cell_weight(const typename parallel::distributed::Triangulation<dim>::cell_iterator& cell,
+                                    const typename parallel::distributed::Triangulation<dim>::CellStatus status);
+
+    //! Returns the cost of the #cell for the partitioning. See #cost_weights
+    unsigned int cost_cell_weight(const typename parallel::distributed::Triangulation<dim>::cell_iterator& cell,
+                                  const typename parallel::distributed::Triangulation<dim>::CellStatus status);
+
+    //! The wall time of the cell loop and the column assembly during the last rebuild of the structure.
+    //! This part has no communication so it measures the local load only
+    double struct_work_time;
+
+    //! Returns the number of active cells under the #cell
+    unsigned int n_active_descendants(const typename parallel::distributed::Triangulation<dim>::cell_iterator& cell);
+
+    //! Returns a checksum of the level, index and subdomain of the locally owned and ghost cells
+    unsigned long long cell_checksum(DoFHandler<dim>& mesh_dof_handler);
+
+    //! Returns true if the triangulation has the same cells on all processors as in the last build
+    bool topology_unchanged(DoFHandler<dim>& mesh_dof_handler, unsigned long long checksum, MPI_Comm& mpi_communicator);
+
+    //! Flags as changed the column of the point p if it exists
+    void flag_column(Point<dim> p);
+
+    //! One flag per column. True if the column has to be rebuilt during the next incremental update
+    std::vector<char> dirty_col;
+
+    //! The elevations of the top and bottom nodes of each node when the structure was built.
+    //! These are used by #reset_to_reference for the top and bottom nodes that live on other processors
+    std::vector<double> top_z_ref;
+    std::vector<double> bot_z_ref;
+
+    /*!
+     * \brief reset_to_reference sets the vertex vector and the elevations of the structure back to the reference
+     * elevations of the #Columns, which are the elevations of the triangulation when the structure was built. The x-y
+     * are taken from the triangulation. The offsets of the next elevation update are then the whole displacement since
+     * the build, so that undoing them restores the triangulation that matches the reference even after many updates
+     * without refinement.
+     */
+    void reset_to_reference(DoFHandler<dim>& mesh_dof_handler,
+                            TrilinosWrappers::MPI::Vector& distributed_mesh_vertices);
+
+    //! The communicator of the traffic of the structure. It is a duplicate of the communicator that is passed
+    //! to the structure, so that its messages never match messages of the application and vice versa
+    MPI_Comm struct_comm;
+    //! The communicator that #struct_comm duplicates
+    MPI_Comm parent_comm;
+
+    //! Returns the #struct_comm. The first call, and any call with a different #mpi_communicator, duplicates
+    //! the #mpi_communicator, therefore it has to be called by all processors at the same point
+    MPI_Comm& structure_comm(MPI_Comm& mpi_communicator);
+
+    //! The processors that own the ghost cells of this processor. These are the processors that share
+    //! columns with this one and the only ones that the exchanges normally talk to
+    std::vector<int> peers;
+
+    //! The first mesh dof that each processor owns followed by the number of dofs. The dofs of each processor are contiguous
+    std::vector<int> dof_range_begin;
+
+    //! Returns the processor that owns the #dof or -9 if the #dof is not in the #dof_range_begin
+    int dof_owner(int dof) const;
+
+    /*!
+     * \brief sweep_cell extracts the z node records, the connections and the constraints of one locally owned or
+     * ghost cell. It runs concurrently on many cells, therefore it only reads the structure and writes into #copy.
+     */
+    void sweep_cell(const typename DoFHandler<dim>::active_cell_iterator& cell,
+                    Sweep_scratch<dim>& scratch,
+                    Sweep_copy<dim>& copy,
+                    const ConstraintMatrix& mesh_constraints,
+                    const TrilinosWrappers::MPI::Vector& distributed_mesh_vertices);
+
+    //! Merges the output of #sweep_cell into the structure. The cells are merged one at a time in the order of the loop
+    void merge_cell(const Sweep_copy<dim>& copy,
+                    TrilinosWrappers::MPI::Vector& distributed_mesh_vertices,
+                    std::set<int>& peer_set);
+
+    //! A scratch list for the results of the #xy_index queries
+    std::vector<int> xy_ids;
+
+    //! The z node records gathered during the cell loop of #updateMeshStruct
+    std::vector<Znode_rec> node_recs;
+
+    //! The index in the #node_recs of the record of each triangulation vertex or -9 if the vertex has not been visited yet.
+    //! A vertex is searched in the #xy_index and added to the records only by the first cell that visits it
+    std::vector<int> vertex_rec;
+    //! The (dof, connected dof) pairs gathered during the cell loop of #updateMeshStruct
+    std::vector<std::pair<int,int> > conn_pairs;
+    //! The (dof, constraint dof) pairs gathered during the cell loop of #updateMeshStruct
+    std::vector<std::pair<int,int> > cnstr_pairs;
 
 };
 
@@ -223,34 +653,53 @@ template <int dim>
 Mesh_struct<dim>::Mesh_struct(double xy_thr, double z_thr){
     xy_thres = xy_thr;
     z_thres = z_thr;
-    _counter = 0;
     dbg_scale_x = 100;
     dbg_scale_z = 10;
+    incremental_update = false;
+    use_elevation_operator = false;
+    elevation_operator_valid = false;
+    move_triangulation = true;
+    imbalance_threshold = 1.2;
+    struct_work_time = 0;
+    elev_plan_valid = false;
+    struct_comm = MPI_COMM_NULL;
+    parent_comm = MPI_COMM_NULL;
+    topology_version = 0;
+    built_topology_version = -9;
+    built_cell_checksum = 0;
+    xy_index.reinit(xy_thres);
 }
 
 template <int dim>
-void Mesh_struct<dim>::add_new_point(Point<dim-1>p, Zinfo zinfo){
+Mesh_struct<dim>::~Mesh_struct(){
+    free_elev_plan();
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if (struct_comm != MPI_COMM_NULL && !finalized)
+        MPI_Comm_free(&struct_comm);
+}
 
-    //if (zinfo.dof == 189)
-    //    std::cout << "SO FAR SO GOOD" << std::endl;
+template <int dim>
+MPI_Comm& Mesh_struct<dim>::structure_comm(MPI_Comm& mpi_communicator){
+    if (struct_comm == MPI_COMM_NULL || parent_comm != mpi_communicator){
+        // The persistent requests are bound to the old communicator
+        free_elev_plan();
+        if (struct_comm != MPI_COMM_NULL)
+            MPI_Comm_free(&struct_comm);
+        MPI_Comm_dup(mpi_communicator, &struct_comm);
+        parent_comm = mpi_communicator;
+    }
+    return struct_comm;
+}
 
-    //if (zinfo.dof < 0)
-    //    std::cerr << "You attepmt to add a point with negative dof" << std::endl << std::flush;
+template <int dim>
+void Mesh_struct<dim>::add_new_point(Point<dim-1>p, Znode_rec zrec){
 
     // First search for the XY location in the structure
     int id = check_if_point_exists(p);
 
-    //if (zinfo.dof == 189)
-    //    std::cout << "id is " << id << std::endl;
-
     if ( id < 0 ){
-        // this is a new point and we add it to the map
-        PntsInfo<dim> tempPnt(p, zinfo);
-        tempPnt.find_id = _counter;
-        PointsMap[_counter] = tempPnt;
-
-        //... to the Cgal structure
-        std::vector< std::pair<ine_Point2,unsigned> > pair_point_id;
+        // this is a new point and we add it to the columns
         double x,y;
         if (dim == 2){
             x = p[0];
@@ -259,19 +708,13 @@ void Mesh_struct<dim>::add_new_point(Point<dim-1>p, Zinfo zinfo){
             x = p[0];
             y = p[1];
         }
-        pair_point_id.push_back(std::make_pair(ine_Point2(x, y), _counter));
-        CGALset.insert(pair_point_id.begin(), pair_point_id.end());
-        _counter++;
-    }else if (id >=0){
-        typename std::map<int, PntsInfo<dim> >::iterator it = PointsMap.find(id);
-        //if (zinfo.dof == 189){
-        //    if (it == PointsMap.end())
-        //        std::cout << "NO WAY" << std::endl;
-        //    else
-        //        std::cout << it->second.PNT[0] << std::endl;
-        //}
-        it->second.add_Zcoord(zinfo, z_thres);
+        id = Columns.add_column(x, y);
+
+        //... to the spatial hash
+        xy_index.insert(id, x, y);
     }
+    zrec.col = id;
+    node_recs.push_back(zrec);
 }
 
 template <int dim>
@@ -286,7 +729,8 @@ int Mesh_struct<dim>::check_if_point_exists(Point<dim-1> p){
         y = p[1];
     }
 
-    std::vector<int> ids = circle_search_in_2DSet(CGALset, ine_Point3(x, y, 0.0) , xy_thres);
+    std::vector<int>& ids = xy_ids;
+    xy_index.find(x, y, Columns.X, Columns.Y, ids);
 
     if (ids.size() > 1)
         std::cerr << "More than one points around x: " << x << ", y: " << y << "found within the specified tolerance" << std::endl;
@@ -300,6 +744,220 @@ int Mesh_struct<dim>::check_if_point_exists(Point<dim-1> p){
     return out;
 }
 
+template <int dim>
+void Mesh_struct<dim>::build_CGALset(){
+    CGALset.clear();
+    std::vector< std::pair<ine_Point2,unsigned> > pair_point_id;
+    pair_point_id.reserve(Columns.n_columns());
+    for (int ic = 0; ic < Columns.n_columns(); ++ic)
+        pair_point_id.push_back(std::make_pair(ine_Point2(Columns.X[ic], Columns.Y[ic]), static_cast<unsigned>(ic)));
+    CGALset.insert(pair_point_id.begin(), pair_point_id.end());
+}
+
+
+template <int dim>
+void Mesh_struct<dim>::sweep_cell(const typename DoFHandler<dim>::active_cell_iterator& cell,
+                                  Sweep_scratch<dim>& scratch,
+                                  Sweep_copy<dim>& copy,
+                                  const ConstraintMatrix& mesh_constraints,
+                                  const TrilinosWrappers::MPI::Vector& distributed_mesh_vertices){
+    copy.ghost_subdomain = -9;
+    copy.pnts.clear();
+    copy.recs.clear();
+    copy.vertices.clear();
+    copy.conn_pairs.clear();
+    copy.cnstr_pairs.clear();
+    copy.cnstr_end.clear();
+    copy.vertex_values.clear();
+    if (cell->is_ghost())
+        copy.ghost_subdomain = static_cast<int>(cell->subdomain_id());
+    if (!cell->is_locally_owned() && !cell->is_ghost())
+        return;
+
+    const FiniteElement<dim>& mesh_fe = scratch.fe_mesh_points.get_fe();
+    bool top_cell = false;
+    bool bot_cell = false;
+    // If the neighbor index of the top or bottom face of the cell is negative
+    // then this cell is either top or bottom.
+    if (cell->neighbor_index(GeometryInfo<dim>::faces_per_cell-2) < 0){
+        bot_cell = true;
+    }
+    if (cell->neighbor_index(GeometryInfo<dim>::faces_per_cell-1) < 0){
+        top_cell = true;
+    }
+
+    scratch.fe_mesh_points.reinit(cell);
+    cell->get_dof_indices (scratch.cell_dof_indices);
+    // First we will loop through the cell dofs gathering all info we need for the points
+    // and then we will loop again though the points to add them into the structure.
+    // Therefore we would need to initialize several vectors
+    std::map<int, trianode<dim> > curr_cell_info;
+
+    for (unsigned int idof = 0; idof < mesh_fe.base_element(0).dofs_per_cell; ++idof){
+        // for each dof of this cell we extract the coordinates and the dofs
+        Point <dim> current_node;
+        std::vector<int> current_dofs(dim);
+        std::vector<unsigned int> spi;
+        for (unsigned int dir = 0; dir < dim; ++dir){
+            // for each cell, the support_point_index spans from 0 to dim*Nvert_per_cell-1
+            // eg for dim =2 spans from 0-7
+            // The first dim indices correspond to x,y,z of the first vertex of triangulation
+            // The current_dofs contains the dof index for each coordinate.
+            // The current_node containts the x,y,z coordinates
+            // The distributed_mesh_vertices is a vector of size Nvertices*dim
+            // essentially we are treating all xyz coordinates as variables although we are going to
+            // change only the vertical component of it (In 2D this is the y).
+            // In the z only mode there is only the vertical component and the x-y come from the triangulation
+            current_node[dir] = scratch.fe_mesh_points.quadrature_point(idof)[dir];
+            const int comp = vertex_component<dim>(mesh_fe, dir);
+            if (comp < 0){
+                spi.push_back(0);
+                current_dofs[dir] = -9;
+                continue;
+            }
+            unsigned int support_point_index = mesh_fe.component_to_system_index(comp, idof );
+            spi.push_back(support_point_index);
+            current_dofs[dir] = static_cast<int>(scratch.cell_dof_indices[support_point_index]);
+            copy.vertex_values.push_back(std::pair<unsigned int, double>(scratch.cell_dof_indices[support_point_index],
+                                                                         current_node[dir]));
+        }
+        // We have now loop throught dofs of a given cell point and we initialize a trianode
+        trianode<dim> temp;
+        temp.pnt = current_node;
+        temp.dof = current_dofs[dim-1];
+        temp.hang = mesh_constraints.is_constrained(current_dofs[dim-1]);
+        temp.cnstr_nd.push_back(current_dofs[dim-1]);
+        if (temp.hang)
+            mesh_constraints.resolve_indices(temp.cnstr_nd);
+        temp.spi = spi[dim-1];
+        temp.islocal = distributed_mesh_vertices.in_local_range(temp.dof);
+        temp.isBot = 0;
+        temp.isTop = 0;
+        if (bot_cell){
+            if (idof < GeometryInfo<dim>::vertices_per_cell/2){
+                temp.isBot = 1;
+            }
+        }
+        if (top_cell){
+            if (idof >= GeometryInfo<dim>::vertices_per_cell/2){
+                temp.isTop = 1;
+            }
+        }
+        // and last we add it to the map
+        curr_cell_info[idof] = temp;
+    }
+
+    typename std::map<int, trianode<dim> >::iterator it;
+    for (it = curr_cell_info.begin(); it != curr_cell_info.end(); ++it){
+
+        // get the nodes connected with this one
+        std::vector<int> id_conn = get_connected_indices<dim>(it->first);
+
+        // keep the dofs of the points conected with this one
+        for (unsigned int i = 0; i < id_conn.size(); ++i){
+            copy.conn_pairs.push_back(std::pair<int,int>(it->second.dof, curr_cell_info[id_conn[i]].dof));
+        }
+
+        // and the dofs of the nodes that this node depends on if its constrained
+        for (unsigned int ii = 0; ii < it->second.cnstr_nd.size(); ++ii){
+            if (static_cast<int>(it->second.cnstr_nd[ii]) == it->second.dof)
+                continue;
+            copy.cnstr_pairs.push_back(std::pair<int,int>(it->second.dof, static_cast<int>(it->second.cnstr_nd[ii])));
+        }
+        copy.cnstr_end.push_back(static_cast<unsigned int>(copy.cnstr_pairs.size()));
+
+        // Now create a z record
+        Znode_rec zrec;
+        zrec.col = -9;
+        zrec.z = it->second.pnt[dim-1];
+        zrec.dof = it->second.dof;
+        zrec.flags = 0;
+        if (it->second.isTop) zrec.flags |= ZF_TOP;
+        if (it->second.isBot) zrec.flags |= ZF_BOT;
+        if (it->second.islocal) zrec.flags |= ZF_LOCAL;
+
+        // and a point
+        Point<dim-1> ptemp;
+        for (unsigned int d = 0; d < dim-1; ++d)
+            ptemp[d] = it->second.pnt[d];
+
+        copy.pnts.push_back(ptemp);
+        copy.recs.push_back(zrec);
+        copy.vertices.push_back(cell->vertex_index(it->first));
+    }
+}
+
+template <int dim>
+void Mesh_struct<dim>::merge_cell(const Sweep_copy<dim>& copy,
+                                  TrilinosWrappers::MPI::Vector& distributed_mesh_vertices,
+                                  std::set<int>& peer_set){
+    if (copy.ghost_subdomain >= 0)
+        peer_set.insert(copy.ghost_subdomain);
+    for (unsigned int i = 0; i < copy.vertex_values.size(); ++i)
+        distributed_mesh_vertices[copy.vertex_values[i].first] = copy.vertex_values[i].second;
+    conn_pairs.insert(conn_pairs.end(), copy.conn_pairs.begin(), copy.conn_pairs.end());
+    for (unsigned int i = 0; i < copy.recs.size(); ++i){
+        int& irec = vertex_rec[copy.vertices[i]];
+        if (irec >= 0){
+            // The vertex has been added by a previous cell. Only its top/bottom flags may be new
+            node_recs[irec].flags |= copy.recs[i].flags;
+            continue;
+        }
+        cnstr_pairs.insert(cnstr_pairs.end(),
+                           copy.cnstr_pairs.begin() + (i == 0 ? 0 : copy.cnstr_end[i-1]),
+                           copy.cnstr_pairs.begin() + copy.cnstr_end[i]);
+        add_new_point(copy.pnts[i], copy.recs[i]);
+        irec = static_cast<int>(node_recs.size()) - 1;
+    }
+}
+
+template <int dim>
+void Mesh_struct<dim>::reset_to_reference(DoFHandler<dim>& mesh_dof_handler,
+                                          TrilinosWrappers::MPI::Vector& distributed_mesh_vertices){
+    const FiniteElement<dim>& mesh_fe = mesh_dof_handler.get_fe();
+    std::vector<types::global_dof_index> cell_dof_indices(mesh_fe.dofs_per_cell);
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = mesh_dof_handler.begin_active(),
+    endc = mesh_dof_handler.end();
+    for (; cell != endc; ++cell){
+        if (!cell->is_locally_owned() && !cell->is_ghost())
+            continue;
+        cell->get_dof_indices(cell_dof_indices);
+        // The support points of the mesh element are the vertices of the cell
+        for (unsigned int iv = 0; iv < GeometryInfo<dim>::vertices_per_cell; ++iv){
+            for (unsigned int dir = 0; dir < dim; ++dir){
+                const int comp = vertex_component<dim>(mesh_fe, dir);
+                if (comp < 0)
+                    continue;
+                const types::global_dof_index idof = cell_dof_indices[mesh_fe.component_to_system_index(comp, iv)];
+                double coord = cell->vertex(iv)[dir];
+                if (dir == dim-1){
+                    // The triangulation may have been moved by more than one update since the build. The elevation
+                    // of the build is the reference, so the next offset is the whole displacement from it
+                    int id = dof_ij.find(static_cast<int>(idof));
+                    if (id >= 0){
+                        coord = Columns.z_ref[id];
+                        Columns.z[id] = coord;
+                    }
+                }
+                distributed_mesh_vertices[idof] = coord;
+            }
+        }
+    }
+    distributed_mesh_vertices.compress(VectorOperation::insert);
+
+    // The top and bottom nodes that this processor knows take their reference elevation from the structure.
+    // The others keep the elevation they had when the structure was built
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        Columns.set(i, ZF_ZSET, false);
+        Columns.Top[i].isSet = false;
+        Columns.Bot[i].isSet = false;
+        int id = dof_ij.find(Columns.Top[i].dof);
+        Columns.Top[i].z = id >= 0 ? Columns.z[id] : top_z_ref[i];
+        id = dof_ij.find(Columns.Bot[i].dof);
+        Columns.Bot[i].z = id >= 0 ? Columns.z[id] : bot_z_ref[i];
+    }
+}
 
 template <int dim>
 void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
@@ -319,20 +977,43 @@ void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
     // get the rank and processor id just for output display
     unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
     unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
+    // The traffic of the structure goes through its own communicator
+    MPI_Comm& comm = structure_comm(mpi_communicator);
+
+    // If the triangulation has not changed since the last build the structure, the dofs and the vectors are still valid.
+    // In that case just clear the per step information and go straight to the elevation update
+    const unsigned long long checksum = cell_checksum(mesh_dof_handler);
+    if (topology_unchanged(mesh_dof_handler, checksum, comm)){
+        pcout << "The triangulation has not changed. Reuse the mesh structure for: " << prefix << std::endl << std::flush;
+        // The vertices and the elevations hold the previous update. Set them back to the triangulation
+        reset_to_reference(mesh_dof_handler, distributed_mesh_vertices);
+        dirty_col.assign(Columns.n_columns(), 0);
+        return;
+    }
 
-    // make sure all processors start together
-    MPI_Barrier(mpi_communicator);
-    reset(); // delete all info in the Mesh structure
-    MPI_Barrier(mpi_communicator);
+    // In an incremental update the columns are kept and only the ones that have changed will be rebuilt
+    const bool patch_columns = incremental_update && Columns.n_nodes() > 0;
+    if (patch_columns)
+        reset_dofs(); // delete only the dof info
+    else
+        reset(); // delete all info in the Mesh structure
+    const int n_col_before = Columns.n_columns();
+    elevation_operator_valid = false;
+    free_elev_plan();
 
     const MappingQ1<dim> mapping;
 
     pcout << "Distribute mesh dofs..." << mesh_dof_handler.n_dofs() << std::endl << std::flush;
 
     mesh_dof_handler.distribute_dofs(mesh_fe);
+    renumber_columns(mesh_dof_handler);
     pcout << "dofs :" << mesh_dof_handler.n_dofs() << std::endl << std::flush;
     mesh_locally_owned = mesh_dof_handler.locally_owned_dofs();
     DoFTools::extract_locally_relevant_dofs (mesh_dof_handler, mesh_locally_relevant);
+    const std::vector<types::global_dof_index>& n_owned_dofs = mesh_dof_handler.n_locally_owned_dofs_per_processor();
+    dof_range_begin.assign(n_owned_dofs.size() + 1, 0);
+    for (unsigned int i = 0; i < n_owned_dofs.size(); ++i)
+        dof_range_begin[i+1] = dof_range_begin[i] + static_cast<int>(n_owned_dofs[i]);
     mesh_vertices.reinit (mesh_locally_owned, mesh_locally_relevant, mpi_communicator);
     distributed_mesh_vertices.reinit(mesh_locally_owned, mpi_communicator);
     mesh_Offset_vertices.reinit (mesh_locally_owned, mesh_locally_relevant, mpi_communicator);
@@ -341,369 +1022,76 @@ void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
     const std::vector<Point<dim> > mesh_support_points
                                   = mesh_fe.base_element(0).get_unit_support_points();
 
-    FEValues<dim> fe_mesh_points (mapping,
-                                  mesh_fe,
-                                  mesh_support_points,
-                                  update_quadrature_points);
-
     mesh_constraints.clear();
     mesh_constraints.reinit(mesh_locally_relevant);
     DoFTools::make_hanging_node_constraints(mesh_dof_handler, mesh_constraints);
     mesh_constraints.close();
 
-    // to avoid duplicate executions we will maintain a map with the dofs that have been
-    // already processed
-    std::map<int,int>::iterator itint;
-    MPI_Barrier(mpi_communicator);
-
-    // Make a list of points in x-y that
-    std::vector<std::vector<Point<dim-1> > > pointsXY(n_proc);
-    std::vector<std::vector<ine_Point2 > > pointsXYcgal(n_proc);
-
     pcout << "Update XYZ structure...for: " << prefix  << std::endl << std::flush;
-    std::vector<unsigned int> cell_dof_indices (mesh_fe.dofs_per_cell);
-    typename DoFHandler<dim>::active_cell_iterator
-    cell = mesh_dof_handler.begin_active(),
-    endc = mesh_dof_handler.end();
-    MPI_Barrier(mpi_communicator);
-    //int dbg_cnt =0;
-    for (; cell != endc; ++cell){ // We will loop through the locally owned and ghost cells
-        if (cell->is_locally_owned() || cell->is_ghost()){
-            bool top_cell = false;
-            bool bot_cell = false;
-            // If the neighbor index of the top or bottom face of the cell is negative
-            // then this cell is either top or bottom.
-            if (cell->neighbor_index(GeometryInfo<dim>::faces_per_cell-2) < 0){
-                bot_cell = true;
-            }
-            if (cell->neighbor_index(GeometryInfo<dim>::faces_per_cell-1) < 0){
-                top_cell = true;
-            }
-
-            fe_mesh_points.reinit(cell);
-            cell->get_dof_indices (cell_dof_indices);
-            // First we will loop through the cell dofs gathering all info we need for the points
-            // and then we will loop again though the points to add them into the structure.
-            // Therefore we would need to initialize several vectors
-            std::map<int, trianode<dim> > curr_cell_info;
-
-
-            for (unsigned int idof = 0; idof < mesh_fe.base_element(0).dofs_per_cell; ++idof){
-                // for each dof of this cell we extract the coordinates and the dofs
-                Point <dim> current_node;
-                std::vector<int> current_dofs(dim);
-                std::vector<unsigned int> spi;
-                for (unsigned int dir = 0; dir < dim; ++dir){
-                    // for each cell, the support_point_index spans from 0 to dim*Nvert_per_cell-1
-                    // eg for dim =2 spans from 0-7
-                    // The first dim indices correspond to x,y,z of the first vertex of triangulation
-                    // The current_dofs contains the dof index for each coordinate.
-                    // The current_node containts the x,y,z coordinates
-                    // The distributed_mesh_vertices is a vector of size Nvertices*dim
-                    // essentially we are treating all xyz coordinates as variables although we are going to
-                    // change only the vertical component of it (In 2D this is the y).
-                    unsigned int support_point_index = mesh_fe.component_to_system_index(dir, idof );
-                    spi.push_back(support_point_index);
-                    current_dofs[dir] = static_cast<int>(cell_dof_indices[support_point_index]);
-                    current_node[dir] = fe_mesh_points.quadrature_point(idof)[dir];
-                    distributed_mesh_vertices[cell_dof_indices[support_point_index]] = current_node[dir];
-
-                    //if (!distributed_mesh_vertices.in_local_range(cell_dof_indices[support_point_index]) && my_rank == 0){
-                    //    pcout << "dir:" << dir << ", idof:" << idof << ", cur_dof:" << current_dofs[dir]
-                    //          <<   ", cur_nd:" << current_node[dir] << ", spi:" << support_point_index << std::endl;
-                    //}
-
-                }
-                // We have now loop throught dofs of a given cell point and we initialize a trianode
-                trianode<dim> temp;
-                temp.pnt = current_node;
-                temp.dof = current_dofs[dim-1];
-                temp.hang = mesh_constraints.is_constrained(current_dofs[dim-1]);
-                temp.cnstr_nd.push_back(current_dofs[dim-1]);
-                mesh_constraints.resolve_indices(temp.cnstr_nd);
-                temp.spi = spi[dim-1];
-                temp.islocal = distributed_mesh_vertices.in_local_range(temp.dof);
-                temp.isBot = 0;
-                temp.isTop = 0;
-                if (bot_cell){
-                    if (idof < GeometryInfo<dim>::vertices_per_cell/2){
-                        temp.isBot = 1;
-                        //std::cout << "bottom point" << std::endl;
-                    }
-                }
-                if (top_cell){
-                    if (idof >= GeometryInfo<dim>::vertices_per_cell/2){
-                        temp.isTop = 1;
-                        //std::cout << "top point" << std::endl;
-                    }
-                }
-                // and last we add it to the map
-                curr_cell_info[idof] = temp;
-            }
-
-            typename std::map<int, trianode<dim> >::iterator it;
-            for (it = curr_cell_info.begin(); it != curr_cell_info.end(); ++it){
-
-                // get the nodes connected with this one
-                std::vector<int> id_conn = get_connected_indices<dim>(it->first);
-
-                // create a vector of the points conected with this one
-                std::vector<int> connectedNodes;
-                for (unsigned int i = 0; i < id_conn.size(); ++i){
-                    connectedNodes.push_back(curr_cell_info[id_conn[i]].dof);
-                }
-
-                // create a vector of ints to hold the nodes that this node depends on if its constrained
-                std::vector<int> temp_cnstr;
-                for (unsigned int ii = 0; ii < it->second.cnstr_nd.size(); ++ii){
-                    temp_cnstr.push_back(it->second.cnstr_nd[ii]);
-                }
-
-                // Now create a zinfo variable
-                Zinfo zinfo(it->second.pnt[dim-1], it->second.dof, temp_cnstr, it->second.isTop, it->second.isBot, connectedNodes);
-                zinfo.is_local = it->second.islocal;
-
-                // and a point
-                Point<dim-1> ptemp;
-                for (unsigned int d = 0; d < dim-1; ++d)
-                    ptemp[d] = it->second.pnt[d];
-
-                add_new_point(ptemp, zinfo);
-            }
+    // We will loop through the locally owned and ghost cells. The cells are processed by many threads and
+    // their records are merged into the structure in the order of the cells, so the result is the same as in a serial loop
+    // Each vertex is searched and added to the structure once, by the first cell that has it
+    std::set<int> peer_set;
+    vertex_rec.assign(mesh_dof_handler.get_triangulation().n_vertices(), -9);
+    const double work_begin_t = MPI_Wtime();
+    WorkStream::run(mesh_dof_handler.begin_active(),
+                    mesh_dof_handler.end(),
+                    std::bind(&Mesh_struct<dim>::sweep_cell, this,
+                              std::placeholders::_1, std::placeholders::_2, std::placeholders::_3,
+                              std::cref(mesh_constraints), std::cref(distributed_mesh_vertices)),
+                    std::bind(&Mesh_struct<dim>::merge_cell, this,
+                              std::placeholders::_1, std::ref(distributed_mesh_vertices), std::ref(peer_set)),
+                    Sweep_scratch<dim>(mapping, mesh_fe, Quadrature<dim>(mesh_support_points)),
+                    Sweep_copy<dim>());
+
+    peers.assign(peer_set.begin(), peer_set.end());
+
+    // Sort and merge the z records into the columns
+    if (patch_columns){
+        Columns.patch(node_recs, conn_pairs, cnstr_pairs, dirty_col, z_thres);
+    }else{
+        Columns.build(node_recs, conn_pairs, cnstr_pairs, z_thres);
+        dirty_col.assign(Columns.n_columns(), 1);
+    }
+    if (Columns.n_columns() > n_col_before || Columns.has_empty_columns()){
+        // The new columns have been appended at the end. Put all columns back in the Morton order of their
+        // location, so that the neighbor columns, which depend on each other, are close in memory.
+        // The columns that the patch has emptied are dropped, otherwise the store and the #xy_index would only grow
+        std::vector<int> col_order;
+        if (Columns.sort_columns(xy_thres, col_order)){
+            permute_vector(dirty_col, col_order);
+            xy_index.reinit(xy_thres);
+            for (int ic = 0; ic < Columns.n_columns(); ++ic)
+                xy_index.insert(ic, Columns.X[ic], Columns.Y[ic]);
         }
+        build_CGALset();
     }
-
-    make_dof_ij_map();
+    make_dof_ij_map(mesh_locally_owned, mesh_locally_relevant);
     set_id_above_below(my_rank);
-    MPI_Barrier(mpi_communicator);
+    struct_work_time = MPI_Wtime() - work_begin_t;
+    dirty_col.assign(Columns.n_columns(), 0);
+    if (built_topology_version != -9) // only if the topology is tracked
+        built_topology_version = static_cast<int>(topology_version);
+    built_cell_checksum = checksum;
 
     //dbg_meshStructInfo3D("Test01_" + prefix + "_", my_rank);
 
 
     // in multi processor simulations more than likely there would be nodes that have as top or bottom information
-    // that lives in another processor. The following code takes care of that.
+    // that lives in another processor. The parts of the shared columns are merged on one of the processors that
+    // share them, which sets every Top/Bot in a fixed number of exchanges
     if (n_proc > 1){
-        // We will maintain two maps to store the nodes that each processor will ask information from other processors
-        std::map<int, new_DOFZ> Top_info;
-        std::map<int, new_DOFZ> Bot_info;
-
-        // And define few standard iterators
-        typename std::map<int ,  PntsInfo<dim> >::iterator it;
-        std::vector<Zinfo>::iterator itz;
-        std::map<int,std::pair<int,int>>::iterator it_dof;
-
-        // The following loop is executed as long as a processor has unknown nodes in its local dofs only
-        // Each processor contains non local dofs but for those their information is not correct other than
-        // they exists in the triangulation. However their connection information is correct
-        int dbg_cnt = 0;
-        while (true){
-            pcout << "--------------" << std::endl;
-            Top_info.clear();
-            Bot_info.clear();
-
-            // gather the unknown dofs from each processor.
-            for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-                for (itz = it->second.Zlist.begin(); itz != it->second.Zlist.end(); ++itz){
-                    if (itz->is_local){
-                        if (itz->Bot.proc < 0){ // we do not know anything about the bottom if we dont know which processor owns the bottom node
-                            Bot_info.insert(std::pair<int,new_DOFZ>(itz->Bot.dof, new_DOFZ()));
-                        }
-                        if (itz->Top.proc < 0){ // we do not know anything about the top if we dont know which processor owns this node
-                            Top_info.insert(std::pair<int,new_DOFZ>(itz->Top.dof, new_DOFZ()));
-                        }
-                    }
-                }
-            }
-
-
-            // Check if there are any nodes to be set. If not the break the loop
-            std::vector<int> top_info_size;
-            std::vector<int> bot_info_size;
-            Send_receive_size(static_cast<unsigned int>(Top_info.size()), n_proc, top_info_size, mpi_communicator);
-            Send_receive_size(static_cast<unsigned int>(Bot_info.size()), n_proc, bot_info_size, mpi_communicator);
-            int temp_count = 0;
-            for (unsigned int i = 0; i < n_proc; ++i){
-                temp_count = temp_count + top_info_size[i] + bot_info_size[i];
-            }
-            if (temp_count == 0)
-                break;
-
-            if (dbg_cnt == 30){
-                std::cout << "updateMeshStruct didnt converge" << std::endl;
-                return;
-            }
-
-
-            MPI_Barrier(mpi_communicator);
-            std::cout << "Proc " << my_rank << " has " << Bot_info.size() << ", " << Top_info.size() << "Bot/Top" << std::endl;
-            //if (my_rank == 2 && Top_info.size() == 1){
-            //    for (unsigned int jj = 0; jj < Top_info.size(); ++jj){
-            //        std::map<int,new_DOFZ>::iterator itd = Top_info.begin();
-                    //std::cout << "Rank " << my_rank << " Top not set " << itd->first << std::endl;
-            //    }
-            //}
-
-
-            // initialize and populate the vectors to be sent
-            std::vector<std::vector<int>> top_send(n_proc);
-            std::vector<std::vector<int>> bot_send(n_proc);
-            std::vector<int> top_size_send;
-            std::vector<int> bot_size_send;
-            for (std::map<int,new_DOFZ>::iterator itd = Top_info.begin(); itd != Top_info.end(); ++itd){
-                top_send[my_rank].push_back(itd->first);
-            }
-            for (std::map<int,new_DOFZ>::iterator itd = Bot_info.begin(); itd != Bot_info.end(); ++itd){
-                bot_send[my_rank].push_back(itd->first);
-            }
-            // Send the unknown top and bottom dofs
-            Send_receive_size(static_cast<unsigned int>(top_send[my_rank].size()), n_proc, top_size_send, mpi_communicator);
-            Sent_receive_data<int>(top_send, top_size_send, my_rank, mpi_communicator, MPI_INT);
-            Send_receive_size(static_cast<unsigned int>(bot_send[my_rank].size()), n_proc, bot_size_send, mpi_communicator);
-            Sent_receive_data<int>(bot_send, bot_size_send, my_rank, mpi_communicator, MPI_INT);
-
-
-            std::vector<std::vector<int>> top_info_proc(n_proc);
-            std::vector<std::vector<int>> top_info_dof_ask(n_proc);
-            std::vector<std::vector<int>> top_info_new_dof(n_proc);
-            std::vector<std::vector<double>> top_z_reply(n_proc);
-            std::vector<std::vector<int>> bot_info_reply(n_proc);
-            std::vector<std::vector<double>> bot_z_reply(n_proc);
-            std::vector<int> send_size;
-
-            // now we will loop through the dofs that the other processors have sent.
-            // Although it seems unessecary we have to loop through the points that this
-            // processor has sent as well because its not uncommon that after few iterations
-            // the actual top/bottom node lives indeed in the same processor.
-            for (unsigned int i_proc = 0; i_proc < n_proc; ++i_proc){
-                // search for the top
-                for (unsigned int i = 0; i < top_send[i_proc].size(); ++i){
-                    // each processor check if it contains the requested dof
-                    it_dof = dof_ij.find(top_send[i_proc][i]);
-                    if (it_dof != dof_ij.end()){
-                        // if yes dof_ij tell us the indices in the structure
-                        int ipnt = it_dof->second.first;
-                        int iz = it_dof->second.second;
-                        if (PointsMap[ipnt].Zlist[iz].is_local){
-                            //if this node is local in this processor we can safely return its information
-                            // we sent
-                            // which processor asked for this node
-                            // the dof that the processor has as unknown
-                            // The dof that this dof has as its top
-                            // and the z elevation of the node that has as its top. if the elevation is -9999
-                            // then this node will sent false z elevation but this will be taken care in a later iteration
-                            top_info_proc[my_rank].push_back(static_cast<int>(i_proc));
-                            top_info_dof_ask[my_rank].push_back(top_send[i_proc][i]);
-                            top_info_new_dof[my_rank].push_back(PointsMap[ipnt].Zlist[iz].Top.dof);
-                            top_z_reply[my_rank].push_back(PointsMap[ipnt].Zlist[iz].Top.z);
-                        }
-                    }
-                }
-
-                // In a similar way we search for the bottom
-                for (unsigned int i = 0; i < bot_send[i_proc].size(); ++i){
-                    it_dof = dof_ij.find(bot_send[i_proc][i]);
-                    if (it_dof != dof_ij.end()){
-                        int ipnt = it_dof->second.first;
-                        int iz = it_dof->second.second;
-                        if (PointsMap[ipnt].Zlist[iz].is_local){
-                            bot_info_reply[my_rank].push_back(static_cast<int>(i_proc));
-                            bot_info_reply[my_rank].push_back(bot_send[i_proc][i]);
-                            bot_info_reply[my_rank].push_back(PointsMap[ipnt].Zlist[iz].Bot.dof);
-                            bot_z_reply[my_rank].push_back(PointsMap[ipnt].Zlist[iz].Bot.z);
-                        }
-                    }
-                }
-            }
-
-            // During development I tried two transfer schemas. 1) put the info into separate vectors (for the top)
-            // and 2) group the tranfers per type (int and double).
-            Send_receive_size(static_cast<unsigned int>(top_info_proc[my_rank].size()), n_proc, send_size, mpi_communicator);
-            Sent_receive_data<int>(top_info_proc, send_size, my_rank, mpi_communicator, MPI_INT);
-            Sent_receive_data<int>(top_info_dof_ask, send_size, my_rank, mpi_communicator, MPI_INT);
-            Sent_receive_data<int>(top_info_new_dof, send_size, my_rank, mpi_communicator, MPI_INT);
-            Sent_receive_data<double>(top_z_reply, send_size, my_rank, mpi_communicator, MPI_DOUBLE);
-
-            Send_receive_size(static_cast<unsigned int>(bot_info_reply[my_rank].size()), n_proc, send_size, mpi_communicator);
-            Sent_receive_data<int>(bot_info_reply, send_size, my_rank, mpi_communicator, MPI_INT);
-            Send_receive_size(static_cast<unsigned int>(bot_z_reply[my_rank].size()), n_proc, send_size, mpi_communicator);
-            Sent_receive_data<double>(bot_z_reply, send_size, my_rank, mpi_communicator, MPI_DOUBLE);
-
-            //std::cout << "Proc " << my_rank << " has " << top_info_reply[my_rank].size() << ", " << top_z_reply[my_rank].size() << std::endl;
-
-
-            // Once again the processor will loop through the other processors replies.
-            // Same as above each processor should check through its own requests too.
-            for (unsigned int i_proc = 0; i_proc < n_proc; ++i_proc){
-                for (unsigned int i = 0; i < top_z_reply[i_proc].size(); ++i){
-                    // if the processor that has asked for this point is me
-                    if (top_info_proc[i_proc][i] == my_rank){
-                        // This is the dof that has the unknown top
-                        int dof_asked = top_info_dof_ask[i_proc][i];
-                        //this is the new top that the other processor suggested
-                        int newdof = top_info_new_dof[i_proc][i];
-                        // and this is the new z that was suggested by the processor
-                        double newz = top_z_reply[i_proc][i];
-                        // This should always be true, but we check for it anyway
-                        std::map<int, new_DOFZ>::iterator itt = Top_info.find(dof_asked);
-                        if (itt != Top_info.end()){
-                            // we update the new dof and new z
-                            itt->second.new_dof = newdof;
-                            itt->second.z = newz;
-                            // but we set the processor only if the z is not -9999
-                            if (!(std::abs(newz + 9999.0) < 0.00001)){
-                                itt->second.proc = static_cast<int>(i_proc);
-                            }
-                        }
-                        else {
-                            std::cout << dof_asked << " NOt found" << std::endl;
-                        }
-                    }
-                }
-
-                // Similarly for the bottom.
-                for (unsigned int i = 0; i < bot_z_reply[i_proc].size(); ++i){
-                    if (bot_info_reply[i_proc][3*i] == my_rank){
-                        int dof_asked = bot_info_reply[i_proc][3*i+1];
-                        int newdof = bot_info_reply[i_proc][3*i+2];
-                        double newz = bot_z_reply[i_proc][i];
-                        std::map<int, new_DOFZ>::iterator itt = Bot_info.find(dof_asked);
-                        if (itt != Bot_info.end()){
-                            itt->second.new_dof = newdof;
-                            itt->second.z = newz;
-                            if (!(std::abs(newz + 9999.0) < 0.00001)){
-                                itt->second.proc = static_cast<int>(i_proc);
-                            }
-                        }
-                    }
-                }
-            }
+        const int n_unknown = SendReceive_PntsInfo<dim>(Columns, xy_thres, static_cast<int>(my_rank), n_proc, comm);
+        if (n_unknown > 0)
+            std::cerr << "Rank " << my_rank << " has " << n_unknown << " nodes with unknown Top/Bot" << std::endl;
+    }
 
-            // We have updated the temporary maps. However we need to assign the updates info to the main
-            // structure
-            for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-                for (itz = it->second.Zlist.begin(); itz != it->second.Zlist.end(); ++itz){
-                    if (itz->is_local){
-                        if (itz->Bot.proc < 0){
-                            std::map<int, new_DOFZ>::iterator itt = Bot_info.find(itz->Bot.dof);
-                            if (itt != Bot_info.end()){
-                                itz->Bot.dof = itt->second.new_dof;
-                                itz->Bot.proc = itt->second.proc;
-                                itz->Bot.z = itt->second.z;
-                            }
-                        }
-                        if (itz->Top.proc < 0){
-                            std::map<int, new_DOFZ>::iterator itt = Top_info.find(itz->Top.dof);
-                            if (itt != Top_info.end()){
-                                itz->Top.dof = itt->second.new_dof;
-                                itz->Top.proc = itt->second.proc;
-                                itz->Top.z = itt->second.z;
-                            }
-                        }
-                    }
-                }
-            }
-            //dbg_meshStructInfo3D("Test02_" + prefix + "_", my_rank);
-        }
+    // Keep the top and bottom elevations of the triangulation in case the structure is reused
+    top_z_ref.resize(Columns.n_nodes());
+    bot_z_ref.resize(Columns.n_nodes());
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        top_z_ref[i] = Columns.Top[i].z;
+        bot_z_ref[i] = Columns.Bot[i].z;
     }
 
     std::clock_t end_t = std::clock();
@@ -711,119 +1099,321 @@ void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
     //std::cout << "====================================================" << std::endl;
     std::cout << "I'm rank " << my_rank << " and spend " << elapsed_secs << " sec on Updating XYZ" << std::endl;
     //std::cout << "====================================================" << std::endl;
-    MPI_Barrier(mpi_communicator);
 }
 
 template <int dim>
 void Mesh_struct<dim>::reset(){
-    _counter = 0;
-    PointsMap.clear();
+    Columns.clear();
     dof_ij.clear();
     CGALset.clear();
+    xy_index.reinit(xy_thres);
+    node_recs.clear();
+    conn_pairs.clear();
+    cnstr_pairs.clear();
 }
 
 template <int dim>
-void Mesh_struct<dim>::n_vertices(int myrank){
-    int Nxy = PointsMap.size();
-    int Nz = 0;
-    typename std::map<int , PntsInfo<dim> >::iterator it;
-    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-        Nz += it->second.Zlist.size();
-    }
-    std::cout << "I'm " << myrank << ", Nxy = " << Nxy << ", Nz = " << Nz << std::endl;
+void Mesh_struct<dim>::reset_dofs(){
+    dof_ij.clear();
+    node_recs.clear();
+    conn_pairs.clear();
+    cnstr_pairs.clear();
 }
 
 template <int dim>
-void Mesh_struct<dim>::dbg_meshStructInfo2D(std::string filename, unsigned int my_rank){
-    const std::string log_file_name = (filename	+ "_" +
-                                       Utilities::int_to_string(my_rank+1, 4) +
-                                       ".txt");
-     std::ofstream log_file;
-     log_file.open(log_file_name.c_str());
-     typename std::map<int , PntsInfo<dim> >::iterator it;
-     for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-         double x,y,z;
-         x = it->second.PNT[0]/dbg_scale_x;
-         if (dim == 3) z = it->second.PNT[1]/dbg_scale_x;
-         else z = 0;
-         y = 0;
-         log_file << std::setprecision(3)
-                  << std::fixed
-                  << std::setw(15) << x << ", "
-                  << std::setw(15) << y << ", "
-                  << std::setw(15) << z << ", "
-                  << std::setw(15) << it->second.T << ", "
-                  << std::setw(15) << it->second.B << ", "
-                  << std::setw(5) << it->second.have_to_send
-                  << std::endl;
-     }
-     log_file.close();
+void Mesh_struct<dim>::flag_changed_columns(parallel::distributed::Triangulation<dim>& triangulation){
+    dirty_col.resize(Columns.n_columns(), 0);
+    typename parallel::distributed::Triangulation<dim>::active_cell_iterator
+    cell = triangulation.begin_active(),
+    endc = triangulation.end();
+    for (; cell != endc; ++cell){
+        if (!cell->is_locally_owned())
+            continue;
+        if (!cell->refine_flag_set() && !cell->coarsen_flag_set())
+            continue;
+        for (unsigned int iv = 0; iv < GeometryInfo<dim>::vertices_per_cell; ++iv)
+            flag_column(cell->vertex(iv));
+
+        // The hanging nodes on the faces of this cell belong to the finer neighbors
+        for (unsigned int iface = 0; iface < GeometryInfo<dim>::faces_per_cell; ++iface){
+            if (cell->at_boundary(iface))
+                continue;
+            if (cell->neighbor(iface)->active())
+                continue;
+            for (unsigned int ichild = 0; ichild < cell->face(iface)->n_children();  ++ichild){
+                for (unsigned int iv = 0; iv < GeometryInfo<dim>::vertices_per_cell; ++iv)
+                    flag_column(cell->neighbor_child_on_subface(iface,ichild)->vertex(iv));
+            }
+        }
+    }
+}
 
+template <int dim>
+void Mesh_struct<dim>::flag_column(Point<dim> p){
+    Point<dim-1> ptemp;
+    for (unsigned int d = 0; d < dim-1; ++d)
+        ptemp[d] = p[d];
+    int id = check_if_point_exists(ptemp);
+    if (id >= 0)
+        dirty_col[id] = 1;
 }
 
 template <int dim>
-void Mesh_struct<dim>::dbg_meshStructInfo3D(std::string filename, unsigned int my_rank){
-    const std::string log_file_name = (filename + "_pnt_" +
-                                       Utilities::int_to_string(my_rank+1, 4) +
-                                       ".txt");
-     std::ofstream log_file;
+void Mesh_struct<dim>::compute_displacement(DoFHandler<dim>& mesh_dof_handler,
+                                            const TrilinosWrappers::MPI::Vector& mesh_vertices,
+                                            TrilinosWrappers::MPI::Vector& distributed_displacement){
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = mesh_dof_handler.begin_active(),
+    endc = mesh_dof_handler.end();
+    for (; cell != endc; ++cell){
+        if (!cell->is_locally_owned())
+            continue;
+        for (unsigned int vertex_no = 0; vertex_no < GeometryInfo<dim>::vertices_per_cell; ++vertex_no){
+            for (unsigned int dir = 0; dir < dim; ++dir){
+                const int comp = vertex_component<dim>(mesh_dof_handler.get_fe(), dir);
+                if (comp < 0)
+                    continue;
+                types::global_dof_index dof = cell->vertex_dof_index(vertex_no, comp);
+                if (distributed_displacement.in_local_range(dof))
+                    distributed_displacement[dof] = mesh_vertices(dof) - cell->vertex(vertex_no)[dir];
+            }
+        }
+    }
+    distributed_displacement.compress(VectorOperation::insert);
+}
+
+template <int dim>
+void Mesh_struct<dim>::track_topology(parallel::distributed::Triangulation<dim>& triangulation){
+    triangulation.signals.post_refinement_on_cell.connect(std::bind(&Mesh_struct<dim>::topology_changed, this));
+    triangulation.signals.pre_coarsening_on_cell.connect(std::bind(&Mesh_struct<dim>::topology_changed, this));
+    triangulation.signals.create.connect(std::bind(&Mesh_struct<dim>::topology_changed, this));
+    triangulation.signals.clear.connect(std::bind(&Mesh_struct<dim>::topology_changed, this));
+    // Until the next build the topology is considered changed
+    topology_changed();
+    built_topology_version = -1;
+}
+
+template <int dim>
+void Mesh_struct<dim>::topology_changed(){
+    topology_version++;
+}
+
+template <int dim>
+void Mesh_struct<dim>::align_columns(parallel::distributed::Triangulation<dim>& triangulation){
+    triangulation.signals.cell_weight.connect(std::bind(&Mesh_struct<dim>::column_cell_weight, this,
+                                                        std::placeholders::_1, std::placeholders::_2));
+}
+
+template <int dim>
+bool Mesh_struct<dim>::columns_on_one_processor(const parallel::distributed::Triangulation<dim>& triangulation,
+                                                MPI_Comm& mpi_communicator){
+    // A coarse cell is split if a processor that owns some of its active cells does not own all of them
+    int n_split = 0;
+    typename parallel::distributed::Triangulation<dim>::cell_iterator
+    cell = triangulation.begin(0),
+    endc = triangulation.end(0);
+    for (; cell != endc; ++cell){
+        bool any_owned = false;
+        bool any_other = false;
+        std::vector<typename parallel::distributed::Triangulation<dim>::cell_iterator> stack(1, cell);
+        while (!stack.empty()){
+            typename parallel::distributed::Triangulation<dim>::cell_iterator c = stack.back();
+            stack.pop_back();
+            if (c->has_children()){
+                for (unsigned int ich = 0; ich < c->n_children(); ++ich)
+                    stack.push_back(c->child(ich));
+            }else if (c->is_locally_owned()){
+                any_owned = true;
+            }else{
+                any_other = true;
+            }
+        }
+        if (any_owned && any_other)
+            n_split++;
+    }
+    return Utilities::MPI::sum(n_split, mpi_communicator) == 0;
+}
+
+template <int dim>
+unsigned int Mesh_struct<dim>::column_cell_weight(const typename parallel::distributed::Triangulation<dim>::cell_iterator& cell,
+                                                  const typename parallel::distributed::Triangulation<dim>::CellStatus status){
+    // Every cell has a default weight of 1000. The extra weight of a coarse cell is many times the
+    // default weight of its cells, so the cuts of the space filling curve land almost always on
+    // the last cell of a coarse cell, which is where the next coarse cell begins
+    const unsigned int column_factor = 100;
+    if (status != parallel::distributed::Triangulation<dim>::CELL_PERSIST)
+        return 0;
+
+    // The cell is the last of its coarse cell if it is the last child at every level
+    typename parallel::distributed::Triangulation<dim>::cell_iterator c = cell;
+    while (c->level() > 0){
+        typename parallel::distributed::Triangulation<dim>::cell_iterator pc = c->parent();
+        if (pc->child(pc->n_children() - 1) != c)
+            return 0;
+        c = pc;
+    }
+    // A coarse cell with many descendants would overflow the weight, so compute it in 64 bits and clamp it
+    const unsigned long long weight = 1000ULL * column_factor * n_active_descendants(c);
+    return static_cast<unsigned int>(std::min(weight,
+                                              static_cast<unsigned long long>(std::numeric_limits<unsigned int>::max())));
+}
+
+template <int dim>
+void Mesh_struct<dim>::cost_weights(parallel::distributed::Triangulation<dim>& triangulation){
+    triangulation.signals.cell_weight.connect(std::bind(&Mesh_struct<dim>::cost_cell_weight, this,
+                                                        std::placeholders::_1, std::placeholders::_2));
+}
+
+template <int dim>
+unsigned int Mesh_struct<dim>::cost_cell_weight(const typename parallel::distributed::Triangulation<dim>::cell_iterator& cell,
+                                                const typename parallel::distributed::Triangulation<dim>::CellStatus status){
+    // The cost is added to the default weight of 1000 of each cell. With this scale a vertex
+    // in a column of 10 nodes weights as much as the cell itself
+    const unsigned int cost_scale = 100;
+    if (status == parallel::distributed::Triangulation<dim>::CELL_INVALID)
+        return 0;
+
+    unsigned int cost = 0;
+    for (unsigned int vertex_no = 0; vertex_no < GeometryInfo<dim>::vertices_per_cell; ++vertex_no){
+        Point<dim-1> p;
+        for (unsigned int d = 0; d < dim-1; ++d)
+            p[d] = cell->vertex(vertex_no)[d];
+        // The vertices of new columns are not known yet and they take only the default weight
+        int ic = check_if_point_exists(p);
+        if (ic < 0)
+            continue;
+        for (int k = Columns.col_ptr[ic]; k < Columns.col_ptr[ic+1]; ++k){
+            cost++;
+            if (Columns.has(k, ZF_HANGING))
+                cost++;
+        }
+    }
+    return cost_scale * cost;
+}
+
+template <int dim>
+bool Mesh_struct<dim>::is_imbalanced(MPI_Comm& mpi_communicator, ConditionalOStream pcout){
+    const double max_t = Utilities::MPI::max(struct_work_time, mpi_communicator);
+    const double avg_t = Utilities::MPI::sum(struct_work_time, mpi_communicator)
+                         / static_cast<double>(Utilities::MPI::n_mpi_processes(mpi_communicator));
+    if (avg_t <= 0)
+        return false;
+    pcout << "Mesh structure imbalance (max/avg): " << max_t/avg_t << std::endl;
+    return max_t/avg_t > imbalance_threshold;
+}
+
+template <int dim>
+unsigned int Mesh_struct<dim>::n_active_descendants(const typename parallel::distributed::Triangulation<dim>::cell_iterator& cell){
+    if (!cell->has_children())
+        return 1;
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < cell->n_children(); ++i)
+        n += n_active_descendants(cell->child(i));
+    return n;
+}
+
+template <int dim>
+unsigned long long Mesh_struct<dim>::cell_checksum(DoFHandler<dim>& mesh_dof_handler){
+    unsigned long long h = 1469598103934665603ULL;
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = mesh_dof_handler.begin_active(),
+    endc = mesh_dof_handler.end();
+    for (; cell != endc; ++cell){
+        if (!cell->is_locally_owned() && !cell->is_ghost())
+            continue;
+        h = (h ^ static_cast<unsigned long long>(cell->level())) * 1099511628211ULL;
+        h = (h ^ static_cast<unsigned long long>(cell->index())) * 1099511628211ULL;
+        h = (h ^ static_cast<unsigned long long>(cell->subdomain_id())) * 1099511628211ULL;
+    }
+    return h;
+}
+
+template <int dim>
+bool Mesh_struct<dim>::topology_unchanged(DoFHandler<dim>& mesh_dof_handler,
+                                          unsigned long long checksum,
+                                          MPI_Comm& mpi_communicator){
+    int changed = 0;
+    if (built_topology_version < 0 ||
+            static_cast<unsigned int>(built_topology_version) != topology_version ||
+            checksum != built_cell_checksum ||
+            Columns.n_nodes() == 0 ||
+            mesh_dof_handler.n_dofs() == 0)
+        changed = 1;
+    changed = Utilities::MPI::max(changed, mpi_communicator);
+    return changed == 0;
+}
+
+template <int dim>
+void Mesh_struct<dim>::n_vertices(int myrank){
+    int Nxy = Columns.n_columns();
+    int Nz = Columns.n_nodes();
+    std::cout << "I'm " << myrank << ", Nxy = " << Nxy << ", Nz = " << Nz << std::endl;
+}
+
+template <int dim>
+void Mesh_struct<dim>::dbg_meshStructInfo2D(std::string filename, unsigned int my_rank){
+    const std::string log_file_name = (filename	+ "_" +
+                                       Utilities::int_to_string(my_rank+1, 4) +
+                                       ".txt");
+     std::ofstream log_file;
      log_file.open(log_file_name.c_str());
+     for (int ic = 0; ic < Columns.n_columns(); ++ic){
+         PntsInfo<dim> pnt(Columns, ic);
+         double x,y,z;
+         x = pnt.PNT()[0]/dbg_scale_x;
+         if (dim == 3) z = pnt.PNT()[1]/dbg_scale_x;
+         else z = 0;
+         y = 0;
+         log_file << std::setprecision(3)
+                  << std::fixed
+                  << std::setw(15) << x << ", "
+                  << std::setw(15) << y << ", "
+                  << std::setw(15) << z << ", "
+                  << std::setw(5) << pnt.size()
+                  << std::endl;
+     }
+     log_file.close();
+
+}
 
-     std::map<std::pair<int,int>, int> line_map;
-     std::pair<std::map<std::pair<int,int>,int>::iterator,bool> ret;
-     int counter = 0;
+template <int dim>
+void Mesh_struct<dim>::dbg_meshStructInfo3D(std::string filename, unsigned int my_rank){
+    const std::string log_file_name = (filename + "_pnt_" +
+                                       Utilities::int_to_string(my_rank+1, 4) +
+                                       ".txt");
+     std::ofstream log_file;
+     log_file.open(log_file_name.c_str());
 
-     typename std::map<int , PntsInfo<dim> >::iterator it;
-     for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-         std::vector<Zinfo>::iterator itz = it->second.Zlist.begin();
-         for (; itz != it->second.Zlist.end(); ++itz){
+     for (int ic = 0; ic < Columns.n_columns(); ++ic){
+         PntsInfo<dim> pnt(Columns, ic);
+         for (int k = 0; k < pnt.size(); ++k){
+             Zinfo itz = pnt.Z(k);
              double x,y,z;
-             x = it->second.PNT[0]/dbg_scale_x;
-             if (dim == 3) z = it->second.PNT[1]/dbg_scale_x;
+             x = pnt.PNT()[0]/dbg_scale_x;
+             if (dim == 3) z = pnt.PNT()[1]/dbg_scale_x;
              else z = 0;
-             y = itz->z/dbg_scale_z;
+             y = itz.z()/dbg_scale_z;
              log_file << std::setprecision(3)
                       << std::fixed
                       << std::setw(15) << x << ", "
                       << std::setw(15) << y << ", "
                       << std::setw(15) << z << ", "
-                      << std::setw(15) << itz->dof << ", "
-                      << std::setw(15) << itz->is_local << ", "
-                      << std::setw(15) << itz->connected_above  << ", "
-                      << std::setw(15) << itz->connected_below << ", "
-                      << std::setw(15) << itz->Top.dof  << ", "
-                      << std::setw(15) << itz->Bot.dof << ", "
-                      << std::setw(15) << itz->Top.z  << ", "
-                      << std::setw(15) << itz->Bot.z << ", "
-                      << std::setw(15) << itz->Top.proc  << ", "
-                      << std::setw(15) << itz->Bot.proc << ", "
-                      << std::setw(15) << itz->isTop << ", "
-                      << std::setw(15) << itz->isBot << ", "
-                      << std::setw(15) << itz->dof_conn.size() << ", "
-                      << std::setw(15) << itz->cnstr_nds.size() << ", "
-                      << std::setw(15) << itz->hanging << ", "
-                      << std::setw(15) << itz->rel_pos  << ", "
-                      << std::setw(15) << it->second.T << ", "
-                      << std::setw(15) << it->second.B << ", "
-                      << std::setw(5) << it->second.have_to_send
+                      << std::setw(15) << itz.dof() << ", "
+                      << std::setw(15) << itz.is_local() << ", "
+                      << std::setw(15) << itz.connected_above()  << ", "
+                      << std::setw(15) << itz.connected_below() << ", "
+                      << std::setw(15) << itz.Top().dof  << ", "
+                      << std::setw(15) << itz.Bot().dof << ", "
+                      << std::setw(15) << itz.Top().z  << ", "
+                      << std::setw(15) << itz.Bot().z << ", "
+                      << std::setw(15) << itz.Top().proc  << ", "
+                      << std::setw(15) << itz.Bot().proc << ", "
+                      << std::setw(15) << itz.isTop() << ", "
+                      << std::setw(15) << itz.isBot() << ", "
+                      << std::setw(15) << itz.n_cnstr() << ", "
+                      << std::setw(15) << itz.hanging() << ", "
+                      << std::setw(15) << itz.rel_pos()
                       << std::endl;
-
-
-             std::map<int, int >::iterator itt;
-             for (unsigned int i = 0; i < itz->dof_conn.size(); ++i){
-                 int a,b;
-                 if (itz->dof < itz->dof_conn[i]){
-                     a = itz->dof;
-                     b = itz->dof_conn[i];
-                 }
-                 else{
-                     a = itz->dof_conn[i];
-                     b = itz->dof;
-                 }
-                 ret = line_map.insert(std::pair<std::pair<int,int>,int>(std::pair<int,int>(a,b),counter));
-                 if (ret.second == true)
-                    counter++;
-             }
          }
      }
      log_file.close();
@@ -874,10 +1464,81 @@ void Mesh_struct<dim>::updateMeshElevation(DoFHandler<dim>& mesh_dof_handler,
                                            ConditionalOStream pcout,
                                            std::string prefix){
     unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
-    unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
 
-    typename std::map<int , PntsInfo<dim> >::iterator it;
-    std::map<int,std::pair<int,int> >::iterator it_ij; // iterator for dof_ij
+    // Compute the new elevations of the local nodes
+    if (!use_elevation_operator || !apply_elevation_operator(mesh_dof_handler, mpi_communicator, pcout)){
+        if (!resolve_elevations(mpi_communicator, pcout))
+            return;
+    }
+
+    //std::cout << " Exit while loop" << std::endl;
+    //dbg_meshStructInfo3D("Test03_" + prefix + "_", my_rank);
+
+
+
+
+    pcout << "The elevations have converged for: " << prefix << std::endl;
+
+    // After we have finished with all updates in the z structure we have to copy the---------------------------------------
+    // new values to the distributed vector. Each node writes only its own locally owned entry, so the nodes
+    // are copied in parallel directly into the local arrays of the vectors
+    {
+        const std::pair<unsigned int, unsigned int> range = distributed_mesh_vertices.local_range();
+        parallel::apply_to_subranges(0, Columns.n_nodes(),
+                                     std::bind(&Mesh_struct<dim>::copy_elevations, this,
+                                               std::placeholders::_1, std::placeholders::_2,
+                                               distributed_mesh_vertices.begin(),
+                                               distributed_mesh_Offset_vertices.begin(),
+                                               range.first, range.second),
+                                     1024);
+    }
+
+
+    // The compress sends the data to the processors that owns the data
+    distributed_mesh_Offset_vertices.compress(VectorOperation::insert);
+    distributed_mesh_vertices.compress(VectorOperation::insert); // This was commented in the original dev code
+
+
+    // updates the elevations and offsets to the constraint nodes --------------------------
+    mesh_constraints.distribute(distributed_mesh_Offset_vertices);
+    mesh_Offset_vertices = distributed_mesh_Offset_vertices;
+
+    mesh_constraints.distribute(distributed_mesh_vertices);
+    mesh_vertices = distributed_mesh_vertices;
+
+    //dbg_meshStructInfo3D("After3D_Elev_" + prefix + "_", my_rank);
+
+
+
+    // If the triangulation is not moved we are done. The deformation is described by the vertex vectors
+    if (!move_triangulation)
+        return;
+
+    //move the actual vertices ------------------------------------------------
+    move_vertices(mesh_dof_handler,
+                  mesh_vertices,
+                  my_rank, prefix);
+
+    std::vector<bool> locally_owned_vertices = triangulation.get_used_vertices();
+    typename parallel::distributed::Triangulation<dim>::active_cell_iterator
+    cell = triangulation.begin_active(),
+    endc = triangulation.end();
+    for (; cell!=endc; ++cell){
+        if (cell->is_artificial() ||
+                (cell->is_ghost() && cell->subdomain_id() < triangulation.locally_owned_subdomain() )){
+            for (unsigned int v=0; v<GeometryInfo<dim>::vertices_per_cell; ++v)
+                locally_owned_vertices[cell->vertex_index(v)] = false;
+        }
+    }
+    triangulation.communicate_locally_moved_vertices(locally_owned_vertices);
+
+}
+
+template <int dim>
+bool Mesh_struct<dim>::resolve_elevations(MPI_Comm& mpi_communicator, ConditionalOStream pcout){
+    unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
+    unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
+    MPI_Comm& comm = structure_comm(mpi_communicator);
 
     //int dbg_iter = 0;
 
@@ -885,285 +1546,719 @@ void Mesh_struct<dim>::updateMeshElevation(DoFHandler<dim>& mesh_dof_handler,
     // It is assumed that the nodes that lay on the top or bottom and they are local have already been
     // assigned with the correct elevation. The relative positions also have been calculated.
 
+    // The nodes that have to be set, ordered so that each node comes after the local nodes it depends on.
+    // A single pass resolves all the local dependencies and only the nodes that wait for remote elevations
+    // remain in the list for the next round.
+    std::vector<int> worklist;
+    std::vector<int> level;
+    identify_dependencies(worklist, level);
+
     // elev_asked is a map that contains the dof and elevations of nodes that belong to other processors and this
     // processor has asked at some point.
     std::map<int, double> elev_asked;
+    // The elevations are asked from the processors that own the dofs, which are found from the dof ranges.
+    // A dof outside the ranges is asked from the neighbor processors and, if a round makes no progress, from all processors.
+    int progress = 1;
+    bool ask_all = false;
     int dbg_cnt = 0;
+
+    // If there is a plan from a previous call, execute it first. Normally this sets all nodes and the loop below
+    // only confirms it. Otherwise the loop continues discovering the missing elevations and the plan is recorded again
+    const bool record_plan = !elev_plan_valid;
+    if (elev_plan_valid)
+        execute_elev_plan(worklist, level, elev_asked, static_cast<int>(my_rank));
+    else
+        free_elev_plan();
+
     while (true){
-        MPI_Barrier(mpi_communicator);
         pcout << "========= " << dbg_cnt << " =========" << std::endl;
 
-        std::vector<int> top_info_size;
-        std::vector<int> bot_info_size;
-        std::vector<std::vector<int>> dof_ask(n_proc);
+        // the key is the dof with unknown elevation and the value the processor that owns it or -9 if unknown
         std::map<int,int> dof_ask_map;
         dof_ask_map.clear();
 
-        int count_not_set = 0;
-        for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-            std::vector<Zinfo>::iterator itz = it->second.Zlist.begin();
-            for (; itz != it->second.Zlist.end(); ++itz){
-                if (itz->is_local){
-                    if (!itz->isZset){
-                        if (itz->hanging == 1){ //-----------------------IS HANGING-------------------------------
-                            // if the node is hanging then compute its new elevation by averaging the
-                            // elevations of the nodes that constraint this one. Do the computation only if all the nodes
-                            // have been set
-                            bool all_known = true;
-                            double sum_z = 0;
-                            for (unsigned int ii = 0; ii < itz->cnstr_nds.size(); ++ii){
-                                // Find if the node exists in the map
-                                bool not_local = false;
-                                it_ij = dof_ij.find(itz->cnstr_nds[ii]);
-                                if (it_ij != dof_ij.end()){// if exists, check if it's local
-                                    if (PointsMap[it_ij->second.first].Zlist[it_ij->second.second].is_local){
-                                        if (PointsMap[it_ij->second.first].Zlist[it_ij->second.second].isZset){
-                                            sum_z += PointsMap[it_ij->second.first].Zlist[it_ij->second.second].z;
-                                        }
-                                        else{
-                                            //std::cout << "Proc " << my_rank << " has " << itz->dof << " with not set local " << itz->cnstr_nds[ii] << std::endl;
-                                            all_known = false;
-                                            break;
-                                        }
-                                    }
-                                    else{ // exists in the dof_ij map but is not local
-                                        not_local = true;
-                                    }
-                                }
-                                else{ // doesn't even exists in the dof_ij map
-                                    not_local = true;
-                                }
-                                if (not_local){
-                                    std::map<int, double>::iterator it_elev;
-                                    it_elev = elev_asked.find(itz->cnstr_nds[ii]);
-                                    if (it_elev != elev_asked.end()){
-                                        sum_z += it_elev->second;
-                                    }
-                                    else{
-                                        //std::cout << "Proc " << my_rank << " has " << itz->dof << " with not set NONlocal " << itz->cnstr_nds[ii] << std::endl;
-                                        all_known = false;
-                                        dof_ask_map.insert(std::pair<int,int>(itz->cnstr_nds[ii],itz->cnstr_nds[ii]));
-                                        break;
-                                    }
-                                }
-                            }
-
-                            if (all_known){
-                                itz->z = sum_z / static_cast<double>(itz->cnstr_nds.size());
-                                itz->isZset = true;
-                            }
-                            else{
-                                count_not_set++;
-                            }
-                        }//-----------------------IS HANGING-------------------------------
-                        else{
-                            if (!itz->Top.isSet) {
-                                // Check if the top is local
-                                if (itz->Top.proc == static_cast<int>(my_rank)){
-                                    it_ij = dof_ij.find(itz->Top.dof);
-                                    if (it_ij != dof_ij.end()){
-                                        if (PointsMap[it_ij->second.first].Zlist[it_ij->second.second].isZset){
-                                            itz->Top.z = PointsMap[it_ij->second.first].Zlist[it_ij->second.second].z;
-                                            itz->Top.isSet = true;
-                                        }
-                                        else{
-                                            //std::cerr << "dof " << PointsMap[it_ij->second.first].Zlist[it_ij->second.second].dof << " has no Z for proc " << my_rank << std::endl;
-                                        }
-                                    }
-                                    else{
-                                        std::cerr << "Node with id " << itz->Top.dof << " is local for proc " << my_rank << " but was not found" << std::endl;
-                                    }
-                                }
-                                else{
-                                    // check if we already know its elevation from another processor
-                                    std::map<int, double>::iterator it_elev;
-                                    it_elev = elev_asked.find(itz->Top.dof);
-                                    if (it_elev != elev_asked.end()){
-                                        itz->Top.z = it_elev->second;
-                                        itz->Top.isSet = true;
-                                    }
-                                    else{
-                                        dof_ask_map.insert(std::pair<int,int>(itz->Top.dof,itz->Top.dof));
-                                    }
-                                }
-                            }
-
-                            if (!itz->Bot.isSet){
-                                // Check if the bottom is local
-                                if (itz->Bot.proc == static_cast<int>(my_rank)){
-                                    it_ij = dof_ij.find(itz->Bot.dof);
-                                    if (it_ij != dof_ij.end()){
-                                        if (PointsMap[it_ij->second.first].Zlist[it_ij->second.second].isZset){
-                                            itz->Bot.z = PointsMap[it_ij->second.first].Zlist[it_ij->second.second].z;
-                                            itz->Bot.isSet = true;
-                                        }
-                                        else{
-                                            //std::cerr << "dof " << PointsMap[it_ij->second.first].Zlist[it_ij->second.second].dof << " has no Z for proc " << my_rank << std::endl;
-                                        }
-                                    }
-                                    else{
-                                        std::cerr << "Node with id " << itz->Bot.dof << " is local for proc " << my_rank << " but was not found" << std::endl;
-                                    }
-                                }
-                                else{
-                                    // check if we already know its elevation from another processor
-                                    std::map<int, double>::iterator it_elev;
-                                    it_elev = elev_asked.find(itz->Bot.dof);
-                                    if (it_elev != elev_asked.end()){
-                                        itz->Bot.z = it_elev->second;
-                                        itz->Bot.isSet = true;
-                                    }
-                                    else{
-                                        dof_ask_map.insert(std::pair<int,int>(itz->Bot.dof,itz->Bot.dof));
-                                    }
-                                }
-                            }
-
-                            if (itz->Top.isSet && itz->Bot.isSet){
-                                itz->z = itz->Top.z * itz->rel_pos + (1.0 - itz->rel_pos) * itz->Bot.z;
-                                itz->isZset = true;
-                            }
-                            else{
-                                count_not_set++;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        // The requests are sent as soon as a level of the pass finds them missing and they are answered as soon as the
+        // nodes are set, while the other processors are still resolving their own nodes. The replies are used only by the
+        // next round, so each round depends only on the previous ones and the recorded plan replays exactly the same rounds
+        Elev_exchange ex(comm, 27, static_cast<int>(my_rank), static_cast<int>(n_proc), ask_all);
+        int count_not_set = resolve_local_pass(worklist, level, elev_asked, static_cast<int>(my_rank),
+                                               dof_ask_map, progress, &ex);
 
-        MPI_Barrier(mpi_communicator);
         std::cout << "Proc " << my_rank << " has " << count_not_set << " not set and " << dof_ask_map.size() << " dofs asked so far" << std::endl;
 
-        // Check if all points have been set
-        std::vector<int> points_not_set(n_proc);
-        Send_receive_size(static_cast<unsigned int>(count_not_set), n_proc, points_not_set, mpi_communicator);
-        count_not_set = 0;
-        for (unsigned int i = 0; i < n_proc; ++i)
-            count_not_set = count_not_set + points_not_set[i];
-        if (count_not_set == 0)
+        // Start the check if all points have been set and complete the exchange while it runs.
+        // If all points are set on every processor the exchange is empty and the loop breaks after it.
+        int counts[2] = {count_not_set, progress};
+        MPI_Request count_req;
+        MPI_Iallreduce(MPI_IN_PLACE, counts, 2, MPI_INT, MPI_SUM, comm, &count_req);
+
+        finish_exchange(ex, elev_asked);
+        progress = ex.n_received;
+
+        Elev_round round;
+        for (std::map<int, std::vector<int> >::iterator it = ex.sent_nodes.begin(); it != ex.sent_nodes.end(); ++it){
+            round.send_procs.push_back(it->first);
+            round.send_nodes.push_back(it->second);
+        }
+        for (std::map<int, std::vector<int> >::iterator it = ex.received_dofs.begin(); it != ex.received_dofs.end(); ++it){
+            round.recv_procs.push_back(it->first);
+            round.recv_dofs.push_back(it->second);
+        }
+
+        MPI_Wait(&count_req, MPI_STATUS_IGNORE);
+        if (counts[0] == 0)
             break;
+        ask_all = counts[1] == 0;
+
+        if (record_plan)
+            elev_plan.push_back(round);
+        else
+            elev_plan_valid = false; // the plan was not enough. Record it again next time
 
         if (dbg_cnt == 20){
             std::cout << "updateMeshElevation didnt converge after 20 iterations" << std::endl;
-            return;
+            return false;
         }
-        //std::cout << "Rank " << my_rank <<" : " << count_not_set << std::endl;
-
-        //copy unknown dofs from map to vector
-        for (unsigned int iproc = 0; iproc < n_proc; ++iproc)
-            dof_ask[iproc].clear();
-        for (std::map<int,int>::iterator itemp = dof_ask_map.begin(); itemp != dof_ask_map.end(); ++itemp)
-            dof_ask[my_rank].push_back(itemp->first);
-
-        MPI_Barrier(mpi_communicator);
-        //std::cout << "Rank " << my_rank << " has " << dof_ask[my_rank].size() << std::endl;
-
-
-        // if there are points that have unkonwn elevations from the local processor
-        // communicate them with the other processors
-        std::vector<int> dof_ask_size(n_proc);
-        Send_receive_size(static_cast<unsigned int>(dof_ask[my_rank].size()), n_proc, dof_ask_size, mpi_communicator);
-        Sent_receive_data<int>(dof_ask, dof_ask_size, my_rank, mpi_communicator, MPI_INT);
-
-        // loop through the requested points and if there are dofs that are local with its elevation set
-        // send them
-        std::vector<std::vector<int>> dof_ask_reply(n_proc);
-        std::vector<std::vector<double>> dof_ask_z(n_proc);
-        for (unsigned int i_proc = 0; i_proc < n_proc; ++i_proc){
-            if (i_proc == my_rank)
-                continue;
-            for (unsigned int i = 0; i < dof_ask[i_proc].size(); ++i){
-                it_ij = dof_ij.find(dof_ask[i_proc][i]);
-                if (it_ij != dof_ij.end()){
-                    int ipnt = it_ij->second.first;
-                    int iz = it_ij->second.second;
-                    if (PointsMap[ipnt].Zlist[iz].is_local){
-                        if (PointsMap[ipnt].Zlist[iz].isZset){
-                            //std::cout << "I'm rank " << my_rank << " and I know the Z for " << dof_ask[i_proc][i] << " : " << PointsMap[ipnt].Zlist[iz].z << std::endl;
-                            dof_ask_reply[my_rank].push_back(dof_ask[i_proc][i]);
-                            dof_ask_z[my_rank].push_back(PointsMap[ipnt].Zlist[iz].z);
-                        }
-                    }
-                }
+        dbg_cnt++;
+    }
+    if (record_plan){
+        init_elev_plan(comm);
+        elev_plan_valid = true;
+    }
+    return true;
+}
+
+template <int dim>
+int Mesh_struct<dim>::resolve_local_pass(std::vector<int>& worklist, std::vector<int>& level,
+                                         std::map<int, double>& elev_asked, int my_rank,
+                                         std::map<int,int>& dof_ask_map, int& progress,
+                                         Elev_exchange* ex){
+    // The nodes of each level are computed in parallel. The levels are processed in order so that
+    // every node finds the local nodes it depends on already set
+    std::vector<std::pair<int,int> > asks(2*worklist.size(), std::pair<int,int>(-9, -9));
+    std::vector<char> done(worklist.size(), 0);
+    for (unsigned int l0 = 0; l0 < worklist.size();){
+        unsigned int l1 = l0;
+        while (l1 < worklist.size() && level[l1] == level[l0])
+            ++l1;
+        parallel::apply_to_subranges(l0, l1,
+                                     std::bind(&Mesh_struct<dim>::resolve_nodes, this,
+                                               std::cref(worklist), std::placeholders::_1, std::placeholders::_2,
+                                               std::cref(elev_asked), my_rank,
+                                               std::ref(asks), std::ref(done)),
+                                     256);
+        if (ex != NULL){
+            std::map<int,int> new_asks;
+            for (unsigned int a = 2*l0; a < 2*l1; ++a){
+                if (asks[a].first >= 0 && dof_ask_map.insert(asks[a]).second)
+                    new_asks.insert(asks[a]);
             }
+            progress_exchange(*ex, new_asks, false);
         }
+        l0 = l1;
+    }
+
+    // Collect the requests and keep only the nodes that are still unknown
+    int count_not_set = 0;
+    unsigned int n_left = 0;
+    for (unsigned int k = 0; k < worklist.size(); ++k){
+        if (done[k])
+            progress++;
+        for (unsigned int a = 2*k; a < 2*k + 2; ++a){
+            if (asks[a].first >= 0)
+                dof_ask_map.insert(asks[a]);
+        }
+        if (!Columns.has(worklist[k], ZF_ZSET)){
+            count_not_set++;
+            level[n_left] = level[k];
+            worklist[n_left++] = worklist[k];
+        }
+    }
+    worklist.resize(n_left);
+    level.resize(n_left);
+    return count_not_set;
+}
 
-        std::vector<int> reply_size(n_proc);
-        Send_receive_size(static_cast<unsigned int>(dof_ask_reply[my_rank].size()), n_proc, reply_size, mpi_communicator);
-        Sent_receive_data<int>(dof_ask_reply, reply_size, my_rank, mpi_communicator, MPI_INT);
-        Sent_receive_data<double>(dof_ask_z, reply_size, my_rank, mpi_communicator, MPI_DOUBLE);
-        // loop again to collect the new points that have Z.
-        // Each processor collects all of them even has not asked about them
-        for (unsigned int i_proc = 0; i_proc < n_proc; ++i_proc){
-            if (i_proc == my_rank)
+template <int dim>
+void Mesh_struct<dim>::renumber_columns(DoFHandler<dim>& mesh_dof_handler){
+    const IndexSet owned = mesh_dof_handler.locally_owned_dofs();
+    const FiniteElement<dim>& fe = mesh_dof_handler.get_fe();
+    std::vector<types::global_dof_index> cell_dof_indices(fe.dofs_per_cell);
+
+    // Every locally owned dof is on a locally owned cell. The vertex of a dof is its index in the base FE_Q(1) element
+    std::vector<Dof_order_rec> recs;
+    std::vector<Point<dim> > pnts;
+    recs.reserve(owned.n_elements());
+    pnts.reserve(owned.n_elements());
+    std::vector<char> seen(owned.n_elements(), 0);
+    double x0 = std::numeric_limits<double>::max();
+    double y0 = std::numeric_limits<double>::max();
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = mesh_dof_handler.begin_active(),
+    endc = mesh_dof_handler.end();
+    for (; cell != endc; ++cell){
+        if (!cell->is_locally_owned())
+            continue;
+        cell->get_dof_indices(cell_dof_indices);
+        for (unsigned int i = 0; i < fe.dofs_per_cell; ++i){
+            if (!owned.is_element(cell_dof_indices[i]))
                 continue;
-            for (unsigned int i = 0; i < dof_ask_reply[i_proc].size(); ++i){
-                elev_asked[dof_ask_reply[i_proc][i]] = dof_ask_z[i_proc][i];
-            }
+            const unsigned int idx = owned.index_within_set(cell_dof_indices[i]);
+            if (seen[idx])
+                continue;
+            seen[idx] = 1;
+            const std::pair<unsigned int, unsigned int> comp = fe.system_to_component_index(i);
+            Dof_order_rec r;
+            r.xy = 0;
+            r.component = comp.first;
+            r.dof = cell_dof_indices[i];
+            Point<dim> p = cell->vertex(comp.second);
+            r.z = p[dim-1];
+            recs.push_back(r);
+            pnts.push_back(p);
+            x0 = std::min(x0, p[0]);
+            if (dim == 3)
+                y0 = std::min(y0, p[1]);
         }
-        dbg_cnt++;
     }
+    if (dim == 2)
+        y0 = 0.0;
+    for (unsigned int k = 0; k < recs.size(); ++k)
+        recs[k].xy = xy_morton_key(pnts[k][0], dim == 3 ? pnts[k][1] : 0.0, x0, y0, xy_thres);
+    std::sort(recs.begin(), recs.end(), sort_Dof_order_rec);
+
+    // The k-th dof in the column order takes the k-th locally owned index
+    std::vector<types::global_dof_index> new_numbers(owned.n_elements());
+    for (unsigned int k = 0; k < recs.size(); ++k)
+        new_numbers[owned.index_within_set(recs[k].dof)] = owned.nth_index_in_set(k);
+    mesh_dof_handler.renumber_dofs(new_numbers);
+}
 
-    //std::cout << " Exit while loop" << std::endl;
-    //dbg_meshStructInfo3D("Test03_" + prefix + "_", my_rank);
+template <int dim>
+int Mesh_struct<dim>::dof_owner(int dof) const{
+    if (dof < 0 || dof_range_begin.size() < 2 || dof >= dof_range_begin.back())
+        return -9;
+    // The processors without dofs have empty ranges and upper_bound skips them
+    return static_cast<int>(std::upper_bound(dof_range_begin.begin(), dof_range_begin.end(), dof) - dof_range_begin.begin()) - 1;
+}
 
+template <int dim>
+void Mesh_struct<dim>::progress_exchange(Elev_exchange& ex, std::map<int,int>& new_asks, bool final){
+    // Ask the new dofs from the processors that own them. The owner of the nodes that constraint the
+    // hanging nodes is found from the dof ranges. The dofs outside the ranges are asked from the
+    // neighbor processors or from all of them
+    std::map<int, std::vector<int> > dof_ask_send;
+    for (std::map<int,int>::iterator itemp = new_asks.begin(); itemp != new_asks.end(); ++itemp){
+        int owner = itemp->second >= 0 ? itemp->second : dof_owner(itemp->first);
+        if (owner >= 0){
+            dof_ask_send[owner].push_back(itemp->first);
+        }else if (ex.ask_all){
+            for (int i_proc = 0; i_proc < ex.n_proc; ++i_proc){
+                if (i_proc != ex.my_rank)
+                    dof_ask_send[i_proc].push_back(itemp->first);
+            }
+        }else{
+            for (unsigned int i = 0; i < peers.size(); ++i)
+                dof_ask_send[peers[i]].push_back(itemp->first);
+        }
+    }
+    for (std::map<int, std::vector<int> >::iterator itr = dof_ask_send.begin(); itr != dof_ask_send.end(); ++itr)
+        ex.exchange.send_request(itr->first, itr->second);
+    new_asks.clear();
+
+    std::vector<std::pair<int, std::pair<int, double> > > replies;
+    ex.exchange.poll(ex.pending, replies);
+    for (unsigned int i = 0; i < replies.size(); ++i){
+        ex.received.push_back(replies[i].second);
+        ex.received_dofs[replies[i].first].push_back(replies[i].second.first);
+        ex.n_received++;
+    }
 
+    // Answer the requests for the local nodes that are set. The requests for nodes of other
+    // processors are ignored
+    std::map<int, std::vector<std::pair<int, double> > > dof_ask_reply;
+    unsigned int n_wait = 0;
+    for (unsigned int i = 0; i < ex.pending.size(); ++i){
+        int id_ij = dof_ij.find(ex.pending[i].second);
+        if (id_ij < 0)
+            continue;
+        Zinfo zn(Columns, id_ij);
+        if (!zn.is_local())
+            continue;
+        if (zn.isZset()){
+            dof_ask_reply[ex.pending[i].first].push_back(std::pair<int, double>(ex.pending[i].second, zn.z()));
+            ex.sent_nodes[ex.pending[i].first].push_back(id_ij);
+        }else if (!final){
+            ex.pending[n_wait++] = ex.pending[i];
+        }
+    }
+    ex.pending.resize(n_wait);
+    for (std::map<int, std::vector<std::pair<int, double> > >::iterator itr = dof_ask_reply.begin(); itr != dof_ask_reply.end(); ++itr)
+        ex.exchange.send_reply(itr->first, itr->second);
+}
 
+template <int dim>
+void Mesh_struct<dim>::finish_exchange(Elev_exchange& ex, std::map<int, double>& elev_asked){
+    // Once all requests have been received and answered no more replies can appear
+    std::map<int,int> no_asks;
+    do{
+        progress_exchange(ex, no_asks, true);
+    }while (!ex.exchange.requests_done());
+    do{
+        progress_exchange(ex, no_asks, true);
+    }while (!ex.exchange.replies_done());
+    for (unsigned int i = 0; i < ex.received.size(); ++i)
+        elev_asked[ex.received[i].first] = ex.received[i].second;
+}
 
-    MPI_Barrier(mpi_communicator);
-    std::cout << "Rank " << my_rank << " has converged" << std::endl;
+template <int dim>
+void Mesh_struct<dim>::init_elev_plan(MPI_Comm& mpi_communicator){
+    for (unsigned int r = 0; r < elev_plan.size(); ++r){
+        Elev_round& round = elev_plan[r];
+        round.send_z.resize(round.send_procs.size());
+        round.recv_z.resize(round.recv_procs.size());
+        round.requests.resize(round.send_procs.size() + round.recv_procs.size());
+        for (unsigned int i = 0; i < round.send_procs.size(); ++i){
+            round.send_z[i].resize(round.send_nodes[i].size());
+            MPI_Send_init(&round.send_z[i][0], static_cast<int>(round.send_z[i].size()), MPI_DOUBLE,
+                          round.send_procs[i], 26, mpi_communicator, &round.requests[i]);
+        }
+        for (unsigned int i = 0; i < round.recv_procs.size(); ++i){
+            round.recv_z[i].resize(round.recv_dofs[i].size());
+            MPI_Recv_init(&round.recv_z[i][0], static_cast<int>(round.recv_z[i].size()), MPI_DOUBLE,
+                          round.recv_procs[i], 26, mpi_communicator, &round.requests[round.send_procs.size() + i]);
+        }
+    }
+}
 
-    MPI_Barrier(mpi_communicator);
+template <int dim>
+void Mesh_struct<dim>::free_elev_plan(){
+    // A structure that is destroyed after MPI_Finalize cannot free its requests. MPI has released them anyway
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    for (unsigned int r = 0; r < elev_plan.size() && !finalized; ++r){
+        for (unsigned int i = 0; i < elev_plan[r].requests.size(); ++i)
+            MPI_Request_free(&elev_plan[r].requests[i]);
+    }
+    elev_plan.clear();
+    elev_plan_valid = false;
+}
 
-    // After we have finished with all updates in the z structure we have to copy the---------------------------------------
-    // new values to the distributed vector
-    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-        std::vector<Zinfo>::iterator itz = it->second.Zlist.begin();
-        for (; itz != it->second.Zlist.end(); ++itz){
-            if (distributed_mesh_vertices.in_local_range(static_cast<unsigned int >(itz->dof))){
-                double dz = itz->z - distributed_mesh_vertices[static_cast<unsigned int >(itz->dof)];
-                distributed_mesh_Offset_vertices[static_cast<unsigned int >(itz->dof)] = dz;
-                distributed_mesh_vertices[static_cast<unsigned int >(itz->dof)] += dz;
+template <int dim>
+void Mesh_struct<dim>::execute_elev_plan(std::vector<int>& worklist, std::vector<int>& level,
+                                         std::map<int, double>& elev_asked, int my_rank){
+    std::map<int,int> dof_ask_map;
+    int progress = 0;
+    for (unsigned int r = 0; r < elev_plan.size(); ++r){
+        Elev_round& round = elev_plan[r];
+        resolve_local_pass(worklist, level, elev_asked, my_rank, dof_ask_map, progress);
+
+        // A node that is not set is sent as NaN and it is not used by the receiver,
+        // which will ask for it again in the discovery loop
+        for (unsigned int i = 0; i < round.send_procs.size(); ++i){
+            for (unsigned int k = 0; k < round.send_nodes[i].size(); ++k){
+                const int id = round.send_nodes[i][k];
+                round.send_z[i][k] = Columns.has(id, ZF_ZSET) ? Columns.z[id] : std::numeric_limits<double>::quiet_NaN();
+            }
+        }
+        if (!round.requests.empty()){
+            MPI_Startall(static_cast<int>(round.requests.size()), &round.requests[0]);
+            MPI_Waitall(static_cast<int>(round.requests.size()), &round.requests[0], MPI_STATUSES_IGNORE);
+        }
+        for (unsigned int i = 0; i < round.recv_procs.size(); ++i){
+            for (unsigned int k = 0; k < round.recv_dofs[i].size(); ++k){
+                if (!std::isnan(round.recv_z[i][k]))
+                    elev_asked[round.recv_dofs[i][k]] = round.recv_z[i][k];
             }
         }
     }
+}
 
+template <int dim>
+void Mesh_struct<dim>::resolve_nodes(const std::vector<int>& worklist, unsigned int begin, unsigned int end,
+                                     const std::map<int, double>& elev_asked, int my_rank,
+                                     std::vector<std::pair<int,int> >& asks,
+                                     std::vector<char>& done){
+    int id_ij; // node index returned by dof_ij
+    for (unsigned int k = begin; k < end; ++k){
+        Zinfo itz(Columns, worklist[k]);
+        if (itz.hanging()){ //-----------------------IS HANGING-------------------------------
+            // if the node is hanging then compute its new elevation by averaging the
+            // elevations of the nodes that constraint this one. Do the computation only if all the nodes
+            // have been set
+            bool all_known = true;
+            double sum_z = 0;
+            for (int ii = 0; ii < itz.n_cnstr(); ++ii){
+                // Find if the node exists in the map
+                bool not_local = false;
+                id_ij = dof_ij.find(itz.cnstr_nds(ii));
+                if (id_ij >= 0){// if exists, check if it's local
+                    Zinfo zc(Columns, id_ij);
+                    if (zc.is_local()){
+                        if (zc.isZset()){
+                            sum_z += zc.z();
+                        }
+                        else{
+                            all_known = false;
+                            break;
+                        }
+                    }
+                    else{ // exists in the dof_ij map but is not local
+                        not_local = true;
+                    }
+                }
+                else{ // doesn't even exists in the dof_ij map
+                    not_local = true;
+                }
+                if (not_local){
+                    std::map<int, double>::const_iterator it_elev;
+                    it_elev = elev_asked.find(itz.cnstr_nds(ii));
+                    if (it_elev != elev_asked.end()){
+                        sum_z += it_elev->second;
+                    }
+                    else{
+                        all_known = false;
+                        asks[2*k] = std::pair<int,int>(itz.cnstr_nds(ii), -9);
+                        break;
+                    }
+                }
+            }
 
-    // The compress sends the data to the processors that owns the data
-    distributed_mesh_Offset_vertices.compress(VectorOperation::insert);
-    distributed_mesh_vertices.compress(VectorOperation::insert); // This was commented in the original dev code
+            if (all_known){
+                itz.z() = sum_z / static_cast<double>(itz.n_cnstr());
+                itz.set_Zset(true);
+                done[k] = 1;
+            }
+        }//-----------------------IS HANGING-------------------------------
+        else{
+            if (!itz.Top().isSet) {
+                // Check if the top is local
+                if (itz.Top().proc == my_rank){
+                    id_ij = dof_ij.find(itz.Top().dof);
+                    if (id_ij >= 0){
+                        Zinfo zt(Columns, id_ij);
+                        if (zt.isZset()){
+                            itz.Top().z = zt.z();
+                            itz.Top().isSet = true;
+                        }
+                    }
+                    else{
+                        std::cerr << "Node with id " << itz.Top().dof << " is local for proc " << my_rank << " but was not found" << std::endl;
+                    }
+                }
+                else{
+                    // check if we already know its elevation from another processor
+                    std::map<int, double>::const_iterator it_elev;
+                    it_elev = elev_asked.find(itz.Top().dof);
+                    if (it_elev != elev_asked.end()){
+                        itz.Top().z = it_elev->second;
+                        itz.Top().isSet = true;
+                    }
+                    else{
+                        asks[2*k] = std::pair<int,int>(itz.Top().dof, itz.Top().proc);
+                    }
+                }
+            }
 
+            if (!itz.Bot().isSet){
+                // Check if the bottom is local
+                if (itz.Bot().proc == my_rank){
+                    id_ij = dof_ij.find(itz.Bot().dof);
+                    if (id_ij >= 0){
+                        Zinfo zb(Columns, id_ij);
+                        if (zb.isZset()){
+                            itz.Bot().z = zb.z();
+                            itz.Bot().isSet = true;
+                        }
+                    }
+                    else{
+                        std::cerr << "Node with id " << itz.Bot().dof << " is local for proc " << my_rank << " but was not found" << std::endl;
+                    }
+                }
+                else{
+                    // check if we already know its elevation from another processor
+                    std::map<int, double>::const_iterator it_elev;
+                    it_elev = elev_asked.find(itz.Bot().dof);
+                    if (it_elev != elev_asked.end()){
+                        itz.Bot().z = it_elev->second;
+                        itz.Bot().isSet = true;
+                    }
+                    else{
+                        asks[2*k+1] = std::pair<int,int>(itz.Bot().dof, itz.Bot().proc);
+                    }
+                }
+            }
 
-    // updates the elevations and offsets to the constraint nodes --------------------------
-    mesh_constraints.distribute(distributed_mesh_Offset_vertices);
-    mesh_Offset_vertices = distributed_mesh_Offset_vertices;
+            if (itz.Top().isSet && itz.Bot().isSet){
+                itz.z() = itz.Top().z * itz.rel_pos() + (1.0 - itz.rel_pos()) * itz.Bot().z;
+                itz.set_Zset(true);
+                done[k] = 1;
+            }
+        }
+    }
+}
 
-    mesh_constraints.distribute(distributed_mesh_vertices);
-    mesh_vertices = distributed_mesh_vertices;
+template <int dim>
+void Mesh_struct<dim>::copy_elevations(int begin, int end, double* vertices, double* offsets,
+                                       unsigned int first, unsigned int last) const{
+    for (int i = begin; i < end; ++i){
+        unsigned int idof = static_cast<unsigned int >(Columns.dof[i]);
+        if (idof >= first && idof < last){
+            double dz = Columns.z[i] - vertices[idof - first];
+            offsets[idof - first] = dz;
+            vertices[idof - first] += dz;
+        }
+    }
+}
 
-    //dbg_meshStructInfo3D("After3D_Elev_" + prefix + "_", my_rank);
+template <int dim>
+const std::map<int,double>* Mesh_struct<dim>::find_elevation_row(int dof,
+                                                                const std::vector<std::map<int,double> >& rows,
+                                                                const std::vector<char>& known,
+                                                                const std::map<int, std::map<int,double> >& rows_asked){
+    int id = dof_ij.find(dof);
+    if (id >= 0 && Columns.has(id, ZF_LOCAL)){
+        if (known[id])
+            return &rows[id];
+        return NULL;
+    }
+    std::map<int, std::map<int,double> >::const_iterator it = rows_asked.find(dof);
+    if (it != rows_asked.end())
+        return &it->second;
+    return NULL;
+}
 
+template <int dim>
+bool Mesh_struct<dim>::assemble_elevation_operator(DoFHandler<dim>& mesh_dof_handler,
+                                                   MPI_Comm& mpi_communicator,
+                                                   ConditionalOStream pcout){
+    unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
+    unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
+    MPI_Comm& comm = structure_comm(mpi_communicator);
 
+    // The row of each local node. The key is the dof of a top or bottom node and the value its weight
+    std::vector<std::map<int,double> > rows(Columns.n_nodes());
+    std::vector<char> known(Columns.n_nodes(), 0);
+    // The rows of the nodes that belong to other processors
+    std::map<int, std::map<int,double> > rows_asked;
 
-    //move the actual vertices ------------------------------------------------
-    move_vertices(mesh_dof_handler,
-                  mesh_vertices,
-                  my_rank, prefix);
+    bool converged = false;
+    int progress = 1;
+    bool ask_all = false;
+    int dbg_cnt = 0;
+    while (true){
+        // the key is the dof with unknown row and the value the processor that owns it or -9 if unknown
+        std::map<int,int> dof_ask_map;
+        int count_not_set = 0;
+        for (int i = 0; i < Columns.n_nodes(); ++i){
+            Zinfo itz(Columns, i);
+            if (!itz.is_local() || known[i])
+                continue;
+            std::map<int,double> row;
+            bool all_known = true;
+            if (itz.isTop() || itz.isBot()){
+                // The top and bottom elevations are the input of the operator
+                row[itz.dof()] = 1.0;
+            }
+            else if (itz.hanging()){
+                // The hanging nodes are the average of the nodes that constraint them
+                for (int ii = 0; ii < itz.n_cnstr(); ++ii){
+                    const std::map<int,double>* rc = find_elevation_row(itz.cnstr_nds(ii), rows, known, rows_asked);
+                    if (rc == NULL){
+                        all_known = false;
+                        int idc = dof_ij.find(itz.cnstr_nds(ii));
+                        if (idc < 0 || !Columns.has(idc, ZF_LOCAL))
+                            dof_ask_map.insert(std::pair<int,int>(itz.cnstr_nds(ii), -9));
+                        break;
+                    }
+                    for (std::map<int,double>::const_iterator it = rc->begin(); it != rc->end(); ++it)
+                        row[it->first] += it->second / static_cast<double>(itz.n_cnstr());
+                }
+            }
+            else{
+                // and the other nodes are interpolated between their top and bottom
+                const std::map<int,double>* rt = find_elevation_row(itz.Top().dof, rows, known, rows_asked);
+                const std::map<int,double>* rb = find_elevation_row(itz.Bot().dof, rows, known, rows_asked);
+                if (rt == NULL && itz.Top().proc != static_cast<int>(my_rank))
+                    dof_ask_map.insert(std::pair<int,int>(itz.Top().dof, itz.Top().proc));
+                if (rb == NULL && itz.Bot().proc != static_cast<int>(my_rank))
+                    dof_ask_map.insert(std::pair<int,int>(itz.Bot().dof, itz.Bot().proc));
+                if (rt == NULL || rb == NULL){
+                    all_known = false;
+                }
+                else{
+                    for (std::map<int,double>::const_iterator it = rt->begin(); it != rt->end(); ++it)
+                        row[it->first] += itz.rel_pos() * it->second;
+                    for (std::map<int,double>::const_iterator it = rb->begin(); it != rb->end(); ++it)
+                        row[it->first] += (1.0 - itz.rel_pos()) * it->second;
+                }
+            }
 
-    std::vector<bool> locally_owned_vertices = triangulation.get_used_vertices();
-    typename parallel::distributed::Triangulation<dim>::active_cell_iterator
-    cell = triangulation.begin_active(),
-    endc = triangulation.end();
-    for (; cell!=endc; ++cell){
-        if (cell->is_artificial() ||
-                (cell->is_ghost() && cell->subdomain_id() < triangulation.locally_owned_subdomain() )){
-            for (unsigned int v=0; v<GeometryInfo<dim>::vertices_per_cell; ++v)
-                locally_owned_vertices[cell->vertex_index(v)] = false;
+            if (all_known){
+                rows[i].swap(row);
+                known[i] = 1;
+                progress++;
+            }
+            else{
+                count_not_set++;
+            }
+        }
+
+        // Start the check if all rows are known and exchange the requests while it completes.
+        // If all rows are known on every processor the exchange is empty and the loop breaks after it
+        int counts[2] = {count_not_set, progress};
+        MPI_Request count_req;
+        MPI_Iallreduce(MPI_IN_PLACE, counts, 2, MPI_INT, MPI_SUM, comm, &count_req);
+        progress = 0;
+
+        // ask the missing rows
+        std::map<int, std::vector<int> > dof_ask_send, dof_ask_recv;
+        for (std::map<int,int>::iterator itemp = dof_ask_map.begin(); itemp != dof_ask_map.end(); ++itemp){
+            int owner = itemp->second >= 0 ? itemp->second : dof_owner(itemp->first);
+            if (owner >= 0){
+                dof_ask_send[owner].push_back(itemp->first);
+            }else if (ask_all){
+                for (unsigned int i_proc = 0; i_proc < n_proc; ++i_proc){
+                    if (i_proc != my_rank)
+                        dof_ask_send[static_cast<int>(i_proc)].push_back(itemp->first);
+                }
+            }else{
+                for (unsigned int i = 0; i < peers.size(); ++i)
+                    dof_ask_send[peers[i]].push_back(itemp->first);
+            }
+        }
+        Sparse_send_receive<int>(dof_ask_send, dof_ask_recv, comm, MPI_INT);
+
+        // Each row of the reply is a record with the dof and -9 that starts the row,
+        // followed by one (dof, column dof, weight) record per entry
+        std::map<int, std::vector<Int_dbl_record<2,1> > > row_send, row_recv;
+        for (std::map<int, std::vector<int> >::iterator itr = dof_ask_recv.begin(); itr != dof_ask_recv.end(); ++itr){
+            for (unsigned int i = 0; i < itr->second.size(); ++i){
+                int id = dof_ij.find(itr->second[i]);
+                if (id < 0 || !Columns.has(id, ZF_LOCAL) || !known[id])
+                    continue;
+                Int_dbl_record<2,1> r;
+                r.i[0] = itr->second[i];
+                r.i[1] = -9;
+                r.d[0] = 0.0;
+                row_send[itr->first].push_back(r);
+                for (std::map<int,double>::const_iterator it = rows[id].begin(); it != rows[id].end(); ++it){
+                    r.i[1] = it->first;
+                    r.d[0] = it->second;
+                    row_send[itr->first].push_back(r);
+                }
+            }
         }
+        Sparse_send_receive<Int_dbl_record<2,1> >(row_send, row_recv, comm, Int_dbl_record<2,1>::mpi_type(), 24);
+
+        for (std::map<int, std::vector<Int_dbl_record<2,1> > >::iterator itr = row_recv.begin(); itr != row_recv.end(); ++itr){
+            const std::vector<Int_dbl_record<2,1> >& rep = itr->second;
+            for (unsigned int k = 0; k < rep.size(); ++k){
+                std::map<int,double>& row = rows_asked[rep[k].i[0]];
+                if (rep[k].i[1] < 0){
+                    row.clear();
+                    progress++;
+                }else{
+                    row[rep[k].i[1]] = rep[k].d[0];
+                }
+            }
+        }
+
+        MPI_Wait(&count_req, MPI_STATUS_IGNORE);
+        if (counts[0] == 0){
+            converged = true;
+            break;
+        }
+        ask_all = counts[1] == 0;
+
+        if (dbg_cnt == 20){
+            std::cout << "assemble_elevation_operator didnt converge after 20 iterations" << std::endl;
+            break;
+        }
+        dbg_cnt++;
+    }
+
+    if (!converged)
+        return false;
+
+    // Copy the rows into the matrix
+    IndexSet locally_owned = mesh_dof_handler.locally_owned_dofs();
+    DynamicSparsityPattern dsp(mesh_dof_handler.n_dofs(), mesh_dof_handler.n_dofs(), locally_owned);
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        if (!known[i])
+            continue;
+        for (std::map<int,double>::const_iterator it = rows[i].begin(); it != rows[i].end(); ++it)
+            dsp.add(Columns.dof[i], it->first);
+    }
+    elevation_operator.clear();
+    elevation_operator.reinit(locally_owned, locally_owned, dsp, mpi_communicator);
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        if (!known[i])
+            continue;
+        for (std::map<int,double>::const_iterator it = rows[i].begin(); it != rows[i].end(); ++it)
+            elevation_operator.set(Columns.dof[i], it->first, it->second);
+    }
+    elevation_operator.compress(VectorOperation::insert);
+    elevation_operator_valid = true;
+    pcout << "Elevation operator assembled after " << dbg_cnt << " rounds" << std::endl;
+    return true;
+}
+
+template <int dim>
+bool Mesh_struct<dim>::apply_elevation_operator(DoFHandler<dim>& mesh_dof_handler,
+                                                MPI_Comm& mpi_communicator,
+                                                ConditionalOStream pcout){
+    if (!elevation_operator_valid){
+        if (!assemble_elevation_operator(mesh_dof_handler, mpi_communicator, pcout))
+            return false;
     }
-    triangulation.communicate_locally_moved_vertices(locally_owned_vertices);
 
+    IndexSet locally_owned = mesh_dof_handler.locally_owned_dofs();
+    TrilinosWrappers::MPI::Vector z_in(locally_owned, mpi_communicator);
+    TrilinosWrappers::MPI::Vector z_out(locally_owned, mpi_communicator);
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        if (Columns.has(i, ZF_LOCAL) && (Columns.has(i, ZF_TOP) || Columns.has(i, ZF_BOT)))
+            z_in[Columns.dof[i]] = Columns.z[i];
+    }
+    z_in.compress(VectorOperation::insert);
+
+    elevation_operator.vmult(z_out, z_in);
+
+    // The input holds the new elevations of all top and bottom nodes. Import the ones that the local nodes point to,
+    // so that their Top/Bot elevations are updated as #resolve_elevations does
+    std::vector<types::global_dof_index> top_bot_dofs;
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        if (!Columns.has(i, ZF_LOCAL))
+            continue;
+        if (Columns.Top[i].dof >= 0)
+            top_bot_dofs.push_back(static_cast<types::global_dof_index>(Columns.Top[i].dof));
+        if (Columns.Bot[i].dof >= 0)
+            top_bot_dofs.push_back(static_cast<types::global_dof_index>(Columns.Bot[i].dof));
+    }
+    std::sort(top_bot_dofs.begin(), top_bot_dofs.end());
+    top_bot_dofs.erase(std::unique(top_bot_dofs.begin(), top_bot_dofs.end()), top_bot_dofs.end());
+    IndexSet top_bot_set(locally_owned.size());
+    top_bot_set.add_indices(top_bot_dofs.begin(), top_bot_dofs.end());
+    top_bot_set.add_indices(locally_owned);
+    top_bot_set.compress();
+    TrilinosWrappers::MPI::Vector z_top_bot(locally_owned, top_bot_set, mpi_communicator);
+    z_top_bot = z_in;
+
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        if (Columns.has(i, ZF_LOCAL)){
+            Columns.z[i] = z_out[Columns.dof[i]];
+            Columns.set(i, ZF_ZSET, true);
+            if (Columns.Top[i].dof >= 0){
+                Columns.Top[i].z = z_top_bot[Columns.Top[i].dof];
+                Columns.Top[i].isSet = true;
+            }
+            if (Columns.Bot[i].dof >= 0){
+                Columns.Bot[i].z = z_top_bot[Columns.Bot[i].dof];
+                Columns.Bot[i].isSet = true;
+            }
+        }
+    }
+    return true;
 }
 
 template <int dim>
@@ -1188,7 +2283,9 @@ void Mesh_struct<dim>::move_vertices(DoFHandler<dim>& mesh_dof_handler,
             for (unsigned int vertex_no = 0; vertex_no < GeometryInfo<dim>::vertices_per_cell; ++vertex_no){
                 Point<dim> &v=cell->vertex(vertex_no);
                 for (unsigned int dir=0; dir < dim; ++dir){
-                    v(dir) = mesh_vertices(cell->vertex_dof_index(vertex_no, dir));
+                    const int comp = vertex_component<dim>(mesh_dof_handler.get_fe(), dir);
+                    if (comp >= 0)
+                        v(dir) = mesh_vertices(cell->vertex_dof_index(vertex_no, comp));
                     if (dir == 0)
                         x = v(dir)/dbg_scale_x;
                     if (dir == 1 && dim == 2){
@@ -1210,7 +2307,8 @@ void Mesh_struct<dim>::move_vertices(DoFHandler<dim>& mesh_dof_handler,
 }
 
 template<int dim>
-void Mesh_struct<dim>::printMesh(std::string filename, unsigned int i_proc, DoFHandler<dim>& mesh_dof_handler){
+void Mesh_struct<dim>::printMesh(std::string filename, unsigned int i_proc, DoFHandler<dim>& mesh_dof_handler,
+                                 const Mapping<dim>* mapping){
     const std::string mesh_file_name = ("mesh_Print" + filename + "_" +
                                         Utilities::int_to_string(i_proc+1, 4) +
                                         ".dat");
@@ -1225,6 +2323,8 @@ void Mesh_struct<dim>::printMesh(std::string filename, unsigned int i_proc, DoFH
         if (cell->is_locally_owned()){
             for (unsigned int vertex_no = 0; vertex_no < GeometryInfo<dim>::vertices_per_cell; ++vertex_no){
                 Point<dim> v=cell->vertex(vertex_no);
+                if (mapping != NULL)
+                    v = mapping->transform_unit_to_real_cell(cell, GeometryInfo<dim>::unit_cell_vertex(vertex_no));
                 for (unsigned int dir=0; dir < dim; ++dir){
                     if (dir == 0)
                         x = v(dir)/dbg_scale_x;
@@ -1255,55 +2355,102 @@ void Mesh_struct<dim>::dbg_set_scales(double xscale, double zscale){
 
 template <int dim>
 void Mesh_struct<dim>::set_id_above_below(int my_rank){
-    typename std::map<int , PntsInfo<dim> >::iterator it;
-    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-        it->second.set_ids_above_below(my_rank);
+    for (int ic = 0; ic < Columns.n_columns(); ++ic){
+        PntsInfo<dim>(Columns, ic).set_ids_above_below(my_rank, dirty_col[ic] != 0);
     }
 }
 
 template  <int dim>
-void Mesh_struct<dim>::make_dof_ij_map(){
-    dof_ij.clear();
-    typename std::map<int , PntsInfo<dim> >::iterator it;
-    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-        for (unsigned int k = 0; k < it->second.Zlist.size(); ++k){
-            dof_ij[it->second.Zlist[k].dof] = std::pair<int,int> (it->first,k);
-        }
+void Mesh_struct<dim>::make_dof_ij_map(const IndexSet& mesh_locally_owned, const IndexSet& mesh_locally_relevant){
+    dof_ij.reinit(mesh_locally_owned, mesh_locally_relevant);
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        dof_ij.set(Columns.dof[i], i);
     }
 }
 
 template <int dim>
-void Mesh_struct<dim>::compute_initial_elevations(MyFunction<dim, dim-1> top_function,
-                                                  MyFunction<dim, dim-1> bot_function,
-                                                  std::vector<double>& vert_discr){
-    std::vector<double>uniform_dist = linspace(0.0, 1.0, vert_discr.size());
-
-    typename std::map<int , PntsInfo<dim> >::iterator it;
-    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-        double top = top_function.value(it->second.PNT);
-        double bot = bot_function.value(it->second.PNT);
-        it->T = top;
-        it->B = bot;
+void Mesh_struct<dim>::identify_dependencies(std::vector<int>& order, std::vector<int>& level){
+    const int N = Columns.n_nodes();
+    order.clear();
+    level.clear();
+
+    // Count for each node the number of local nodes with unknown elevation it depends on
+    // and keep the reverse relations (who depends on each node) in CSR form
+    std::vector<int> n_deps(N, 0);
+    std::vector<std::pair<int,int> > edges; // (node, node that depends on it)
+    std::vector<int> deps;
+    for (int i = 0; i < N; ++i){
+        Zinfo itz(Columns, i);
+        if (!itz.is_local() || itz.isZset())
+            continue;
+        deps.clear();
+        if (itz.hanging()){
+            for (int ii = 0; ii < itz.n_cnstr(); ++ii)
+                deps.push_back(dof_ij.find(itz.cnstr_nds(ii)));
+        }else{
+            deps.push_back(dof_ij.find(itz.Top().dof));
+            deps.push_back(dof_ij.find(itz.Bot().dof));
+        }
+        std::sort(deps.begin(), deps.end());
+        deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+        for (unsigned int k = 0; k < deps.size(); ++k){
+            int j = deps[k];
+            if (j < 0 || !Columns.has(j, ZF_LOCAL) || Columns.has(j, ZF_ZSET))
+                continue;
+            edges.push_back(std::pair<int,int>(j, i));
+            n_deps[i]++;
+        }
     }
-}
 
-template <int dim>
-void Mesh_struct<dim>::identify_local_connections(){
-    typename std::map<int , PntsInfo<dim> >::iterator it;
-    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-        it->second.set_local_above_below();
+    std::vector<int> dep_ptr(N + 1, 0);
+    for (unsigned int k = 0; k < edges.size(); ++k)
+        dep_ptr[edges[k].first + 1]++;
+    for (int i = 0; i < N; ++i)
+        dep_ptr[i+1] += dep_ptr[i];
+    std::vector<int> dependents(edges.size());
+    std::vector<int> pos(dep_ptr.begin(), dep_ptr.end() - 1);
+    for (unsigned int k = 0; k < edges.size(); ++k)
+        dependents[pos[edges[k].first]++] = edges[k].second;
+
+    // Topological sort. Start from the nodes that depend only on known or remote elevations
+    std::vector<int> node_level(N, 0);
+    for (int i = 0; i < N; ++i){
+        if (Columns.has(i, ZF_LOCAL) && !Columns.has(i, ZF_ZSET) && n_deps[i] == 0)
+            order.push_back(i);
+    }
+    int max_level = 0;
+    for (unsigned int k = 0; k < order.size(); ++k){
+        int j = order[k];
+        max_level = std::max(max_level, node_level[j]);
+        for (int e = dep_ptr[j]; e < dep_ptr[j+1]; ++e){
+            node_level[dependents[e]] = std::max(node_level[dependents[e]], node_level[j] + 1);
+            if (--n_deps[dependents[e]] == 0)
+                order.push_back(dependents[e]);
+        }
     }
-}
 
-template <int dim>
-void Mesh_struct<dim>::identify_dependencies(){
-    typename std::map<int , PntsInfo<dim> >::iterator it;
-    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-        std::vector<Zinfo>::iterator itz = it->second.Zlist.begin();
-        for (; itz != it->second.Zlist.end(); ++itz){
-            //it->second.
+    // The nodes that have not been added are in a cycle
+    for (int i = 0; i < N; ++i){
+        if (Columns.has(i, ZF_LOCAL) && !Columns.has(i, ZF_ZSET) && n_deps[i] > 0){
+            node_level[i] = ++max_level;
+            order.push_back(i);
         }
     }
+
+    // Group the nodes by level. A node always has a higher level than the nodes it depends on
+    std::vector<int> lvl_ptr(max_level + 2, 0);
+    for (unsigned int k = 0; k < order.size(); ++k)
+        lvl_ptr[node_level[order[k]] + 1]++;
+    for (int l = 0; l <= max_level; ++l)
+        lvl_ptr[l+1] += lvl_ptr[l];
+    std::vector<int> sorted(order.size());
+    level.resize(order.size());
+    for (unsigned int k = 0; k < order.size(); ++k){
+        int l = node_level[order[k]];
+        level[lvl_ptr[l]] = l;
+        sorted[lvl_ptr[l]++] = order[k];
+    }
+    order.swap(sorted);
 }
 
 
@@ -4,6 +4,10 @@
 #include <algorithm>
 
 #include <vector>
+#include <map>
+#include <list>
+#include <set>
+#include <cmath>
 #include <mpi.h>
 #include "pnt_info.h"
 
@@ -17,77 +21,295 @@ void print_size_msg(std::vector<std::vector<T>> v, int my_rank){
 }
 
 /*!
- * \brief Send_receive_size: Each processor sends and receives an integer
- * \param N This is the integer to be sent from this processor
- * \param n_proc The total number of processors
- * \param output A vector of size n_proc which containts the integer that all processors have been sent
- * \param comm The typical MPI communicator
+ * \brief Gather_view holds the data that all processors sent with #All_gather_data.
+ * The data of all processors are stored in a single buffer exactly as they were received and
+ * the data of the processor i are the range [#begin(i), #end(i)).
  */
-void Send_receive_size(unsigned int N, unsigned int n_proc, std::vector<int> &output, MPI_Comm comm){
-
-        output.clear();
-        output.resize(n_proc);
-        std::vector<int> temp(n_proc,1);
-        std::vector<int> displs(n_proc);
-        for (unsigned int i=1; i<n_proc; i++)
-                displs[i] = displs[i-1] + 1;
-
-        MPI_Allgatherv(&N, // This is what this processor will send to every other
-                       1, //This is the size of the message from this processor
-                       MPI_INT, // The data type will be sent
-                       &output[0], // This is where the data will be send on each processor
-                       &temp[0], // an array with the number of points to be sent/receive
-                       &displs[0],
-                       MPI_INT, comm);
+template <typename T1>
+struct Gather_view{
+    //! The received data of all processors one after the other
+    std::vector<T1> data;
+    //! The offset of the data of each processor in #data. It has n_proc + 1 entries
+    std::vector<int> displs;
+
+    const T1* begin(unsigned int i_proc) const {return data.data() + displs[i_proc];}
+    const T1* end(unsigned int i_proc) const {return data.data() + displs[i_proc+1];}
+    int size(unsigned int i_proc) const {return displs[i_proc+1] - displs[i_proc];}
+};
+
+/*!
+ * \brief All_gather_data sends the #send vector to all processors and receives the vectors of all processors.
+ * The sizes are exchanged with a single MPI_Allgather and the data are received directly in the buffer of the #recv view.
+ * \param send the data of this processor
+ * \param recv On output it contains the data of all processors including this one
+ * \param comm The MPI communicator
+ * \param MPI_TYPE The mpi type which should match with the templated parameter T1
+ */
+template <typename T1>
+void All_gather_data(const std::vector<T1>& send,
+                     Gather_view<T1>& recv,
+                     MPI_Comm comm,
+                     MPI_Datatype MPI_TYPE){
+    int n_proc;
+    MPI_Comm_size(comm, &n_proc);
+    int N = static_cast<int>(send.size());
+    std::vector<int> counts(n_proc);
+    MPI_Allgather(&N, 1, MPI_INT, &counts[0], 1, MPI_INT, comm);
+
+    recv.displs.resize(n_proc + 1);
+    recv.displs[0] = 0;
+    for (int i = 0; i < n_proc; ++i)
+        recv.displs[i+1] = recv.displs[i] + counts[i];
+    recv.data.resize(recv.displs[n_proc]);
+
+    MPI_Allgatherv(send.data(), N, MPI_TYPE,
+                   recv.data.data(), &counts[0], &recv.displs[0], MPI_TYPE, comm);
 }
 
 /*!
- * \brief Sent_receive_data: This function sends a vector to all processors and receives all the vectors that the other processor
- * have sent
- * \param data Is a vector of vectors of type T1 with size equal to n_proc.
- * \param N_data_per_proc This is the amount of data that each processor will send.
- * Typically prior to this function the Send_receive_size function should be called to send the sizes
- * \param my_rank the rank of the current processor
+ * \brief Int_dbl_record is a message record of #N_INT ints followed by #N_DBL doubles.
+ * The MPI datatype of the record is created from the layout of the struct, so that a vector of records with mixed
+ * ints and doubles is sent as a single message, e.g. with #Sparse_send_receive, where the receiver gets the size
+ * from the probe of the message itself.
+ */
+template <int N_INT, int N_DBL>
+struct Int_dbl_record{
+    int i[N_INT];
+    double d[N_DBL];
+
+    //! Returns the committed MPI datatype of the record. It is created at the first call
+    static MPI_Datatype mpi_type(){
+        static MPI_Datatype type = create_type();
+        return type;
+    }
+
+private:
+    static MPI_Datatype create_type();
+};
+
+template <int N_INT, int N_DBL>
+MPI_Datatype Int_dbl_record<N_INT, N_DBL>::create_type(){
+    Int_dbl_record<N_INT, N_DBL> r;
+    int lengths[2] = {N_INT, N_DBL};
+    MPI_Aint base, displs[2];
+    MPI_Get_address(&r, &base);
+    MPI_Get_address(&r.i[0], &displs[0]);
+    MPI_Get_address(&r.d[0], &displs[1]);
+    displs[0] -= base;
+    displs[1] -= base;
+    MPI_Datatype types[2] = {MPI_INT, MPI_DOUBLE};
+
+    // The extent is resized to the size of the struct so that the padding of consecutive records is skipped
+    MPI_Datatype tmp, type;
+    MPI_Type_create_struct(2, lengths, displs, types, &tmp);
+    MPI_Type_create_resized(tmp, 0, sizeof(Int_dbl_record<N_INT, N_DBL>), &type);
+    MPI_Type_free(&tmp);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+/*!
+ * \brief Sparse_send_receive: Each processor sends a vector to a few other processors and receives the vectors
+ * that the other processors have sent to it. Unlike #All_gather_data the data are not broadcasted to every processor
+ * and the processors do not need to know in advance who is going to send them data.
+ * This uses the non blocking consensus algorithm: the data are sent with synchronous non blocking sends, the incoming
+ * messages are probed and once all the sends of this processor have been received a non blocking barrier is started.
+ * When the barrier completes every message has been delivered.
+ * \param send is a map where the key is the destination processor and the value the data to send.
+ * Empty vectors are not sent. The destination can be the current processor.
+ * \param recv On output the key is the processor that sent data and the value is the received data.
  * \param comm The MPI communicator
  * \param MPI_TYPE The mpi type which should match with the templated parameter T1
+ * \param tag The tag of the messages. Use different tags for exchanges that may overlap
  */
 template <typename T1>
-void Sent_receive_data(std::vector<std::vector<T1> > &data,
-                       std::vector <int> N_data_per_proc,
-                       unsigned int my_rank,
-                       MPI_Comm comm,
-                       MPI_Datatype MPI_TYPE){
-
-    // data is a vector of vectors of type T1 with size equal to n_proc.
-    // This function transfer to all processors the content of data[my_rank]
-    // if there are any data in data[i], where i=[1,n_proc; i!=myrank] this will be deleted
-    // The size of data[my_rank].size() = N_data_per_proc[my_rank]. This is the responsibility of user
-
-    int N = data[my_rank].size();
-    unsigned int n_proc = data.size();
-    std::vector<int> displs(n_proc);
-    displs[0] = 0;
-    for (unsigned int i=1; i<n_proc; i++)
-            displs[i] = displs[i-1] + N_data_per_proc[i-1];
-
-    int totdata = displs[n_proc-1] + N_data_per_proc[n_proc-1];
-    std::vector<T1> temp_receive(totdata);
-
-    MPI_Allgatherv(&data[my_rank][0], // This is what this processor will send to every other
-                   N, //This is the size of the message from this processor
-                   MPI_TYPE, // The data type will be sent
-                   &temp_receive[0], // This is where the data will be send on each processor
-                   &N_data_per_proc[0], // an array with the number of points to be sent/receive
-                   &displs[0],
-                   MPI_TYPE, comm);
-
-    // Now put the data in the data vector
-    for (unsigned int i = 0; i < n_proc; ++i){
-            data[i].clear();
-            data[i].resize(N_data_per_proc[i]);
-            for (int j = 0; j < N_data_per_proc[i]; ++j)
-                    data[i][j] = temp_receive[displs[i] +j];
+void Sparse_send_receive(std::map<int, std::vector<T1> >& send,
+                         std::map<int, std::vector<T1> >& recv,
+                         MPI_Comm comm,
+                         MPI_Datatype MPI_TYPE,
+                         int tag = 23){
+    recv.clear();
+    std::vector<MPI_Request> send_req;
+    send_req.reserve(send.size());
+    for (typename std::map<int, std::vector<T1> >::iterator it = send.begin(); it != send.end(); ++it){
+        if (it->second.size() == 0)
+            continue;
+        send_req.push_back(MPI_REQUEST_NULL);
+        MPI_Issend(&it->second[0], static_cast<int>(it->second.size()), MPI_TYPE,
+                   it->first, tag, comm, &send_req.back());
+    }
+
+    MPI_Request barrier_req;
+    bool barrier_started = false;
+    while (true){
+        int flag = 0;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, tag, comm, &flag, &status);
+        if (flag){
+            int count;
+            MPI_Get_count(&status, MPI_TYPE, &count);
+            std::vector<T1>& buf = recv[status.MPI_SOURCE];
+            buf.resize(count);
+            MPI_Recv(&buf[0], count, MPI_TYPE, status.MPI_SOURCE, tag, comm, MPI_STATUS_IGNORE);
+        }
+
+        if (barrier_started){
+            int done = 0;
+            MPI_Test(&barrier_req, &done, MPI_STATUS_IGNORE);
+            if (done)
+                break;
+        }else{
+            int all_sent = 0;
+            MPI_Testall(static_cast<int>(send_req.size()), send_req.data(), &all_sent, MPI_STATUSES_IGNORE);
+            if (all_sent){
+                MPI_Ibarrier(comm, &barrier_req);
+                barrier_started = true;
+            }
+        }
+    }
+}
+
+/*!
+ * \brief The Async_exchange class is a request/reply exchange that runs while the processors are still working.
+ *
+ * The requests are lists of dofs and the replies are (dof, value) records. Requests can be sent at any point of the local
+ * work and #poll returns the requests and the replies that have arrived so far, so the caller answers the requests and
+ * uses the replies as they come. When the local work is over the caller polls until #requests_done returns true and then
+ * until #replies_done returns true. Each of the two is the non blocking consensus of #Sparse_send_receive: once every
+ * request has been received (and answered) no more replies can appear, and once every reply has been received the exchange is over.
+ * The requests use the #tag and the replies #tag + 1.
+ */
+class Async_exchange{
+public:
+    Async_exchange(MPI_Comm comm, int tag);
+
+    //! Sends the #dofs to the processor #proc. No requests can be sent after the first call of #requests_done
+    void send_request(int proc, const std::vector<int>& dofs);
+
+    //! Sends the #dof_val pairs to the processor #proc. No replies can be sent after the first call of #replies_done
+    void send_reply(int proc, const std::vector<std::pair<int, double> >& dof_val);
+
+    /*!
+     * \brief poll receives all the messages that have arrived.
+     * Once #requests_done has returned true only the replies are received. The requests that arrive then belong
+     * to the next exchange of a processor that has already finished this one.
+     * \param requests the received requests are appended as (processor, dof)
+     * \param replies the received replies are appended as (processor, (dof, value))
+     */
+    void poll(std::vector<std::pair<int,int> >& requests,
+              std::vector<std::pair<int, std::pair<int, double> > >& replies);
+
+    //! Returns true when all the requests of all processors have been received
+    bool requests_done();
+
+    //! Returns true when all the replies of all processors have been received. Call it after #requests_done returned true
+    bool replies_done();
+
+private:
+    //! Starts the barrier of the next stage once all #reqs have been received or tests the barrier that is running
+    bool stage_done(std::vector<MPI_Request>& reqs, int first_stage);
+
+    MPI_Comm comm;
+    int tag;
+
+    //! The send buffers. They must live until the sends are complete
+    std::list<std::vector<int> > request_buf;
+    std::list<std::vector<Int_dbl_record<1,1> > > reply_buf;
+
+    std::vector<MPI_Request> request_req;
+    std::vector<MPI_Request> reply_req;
+    MPI_Request barrier_req;
+
+    //! 0: sending requests, 1: requests barrier started, 2: sending replies, 3: replies barrier started, 4: done
+    int stage;
+};
+
+Async_exchange::Async_exchange(MPI_Comm comm_in, int tag_in)
+    :
+      comm(comm_in),
+      tag(tag_in),
+      barrier_req(MPI_REQUEST_NULL),
+      stage(0)
+{}
+
+void Async_exchange::send_request(int proc, const std::vector<int>& dofs){
+    if (dofs.size() == 0)
+        return;
+    request_buf.push_back(dofs);
+    request_req.push_back(MPI_REQUEST_NULL);
+    MPI_Issend(&request_buf.back()[0], static_cast<int>(dofs.size()), MPI_INT,
+               proc, tag, comm, &request_req.back());
+}
+
+void Async_exchange::send_reply(int proc, const std::vector<std::pair<int, double> >& dof_val){
+    if (dof_val.size() == 0)
+        return;
+    reply_buf.push_back(std::vector<Int_dbl_record<1,1> >(dof_val.size()));
+    std::vector<Int_dbl_record<1,1> >& buf = reply_buf.back();
+    for (unsigned int i = 0; i < dof_val.size(); ++i){
+        buf[i].i[0] = dof_val[i].first;
+        buf[i].d[0] = dof_val[i].second;
     }
+    reply_req.push_back(MPI_REQUEST_NULL);
+    MPI_Issend(&buf[0], static_cast<int>(buf.size()), Int_dbl_record<1,1>::mpi_type(),
+               proc, tag+1, comm, &reply_req.back());
+}
+
+void Async_exchange::poll(std::vector<std::pair<int,int> >& requests,
+                          std::vector<std::pair<int, std::pair<int, double> > >& replies){
+    while (true){
+        int flag = 0;
+        MPI_Status status;
+        if (stage < 2)
+            MPI_Iprobe(MPI_ANY_SOURCE, tag, comm, &flag, &status);
+        if (flag){
+            int count;
+            MPI_Get_count(&status, MPI_INT, &count);
+            std::vector<int> buf(count);
+            MPI_Recv(&buf[0], count, MPI_INT, status.MPI_SOURCE, tag, comm, MPI_STATUS_IGNORE);
+            for (int i = 0; i < count; ++i)
+                requests.push_back(std::pair<int,int>(status.MPI_SOURCE, buf[i]));
+            continue;
+        }
+        MPI_Iprobe(MPI_ANY_SOURCE, tag+1, comm, &flag, &status);
+        if (flag){
+            int count;
+            MPI_Get_count(&status, Int_dbl_record<1,1>::mpi_type(), &count);
+            std::vector<Int_dbl_record<1,1> > buf(count);
+            MPI_Recv(&buf[0], count, Int_dbl_record<1,1>::mpi_type(), status.MPI_SOURCE, tag+1, comm, MPI_STATUS_IGNORE);
+            for (int i = 0; i < count; ++i)
+                replies.push_back(std::pair<int, std::pair<int, double> >(status.MPI_SOURCE,
+                                  std::pair<int, double>(buf[i].i[0], buf[i].d[0])));
+            continue;
+        }
+        break;
+    }
+}
+
+bool Async_exchange::requests_done(){
+    return stage_done(request_req, 0);
+}
+
+bool Async_exchange::replies_done(){
+    return stage_done(reply_req, 2);
+}
+
+bool Async_exchange::stage_done(std::vector<MPI_Request>& reqs, int first_stage){
+    if (stage == first_stage){
+        int all_sent = 0;
+        MPI_Testall(static_cast<int>(reqs.size()), reqs.data(), &all_sent, MPI_STATUSES_IGNORE);
+        if (all_sent){
+            MPI_Ibarrier(comm, &barrier_req);
+            stage++;
+        }
+    }
+    if (stage == first_stage + 1){
+        int done = 0;
+        MPI_Test(&barrier_req, &done, MPI_STATUS_IGNORE);
+        if (done)
+            stage++;
+    }
+    return stage > first_stage + 1;
 }
 
 /*!
@@ -110,312 +332,258 @@ T get_v(std::vector<std::vector<T> > v, unsigned int i, unsigned int j){
     return 0;
 }
 
-//
-// * \brief Sent_receive_data: This function distributes a vector of type #PntsInfo class.
-// * Before the function each processor knows only the values of #Pnts[#my_rank],
-// * while after the execution of this function all the  #Pnts[0, ... #my_rank] are populated with values
-// * \param Pnts Is a vector of vectors of type PntsInfo<dim> with size equal to n_proc.
-// * This is the input and output of this function.
-// * As input only the #my_rank element has data, and the ohter elements are emput.
-// *  Each point contains, in addition to the standard Point information a list of processors that share
-// * the points as well the key where this point can be found.
-// * \param my_rank the rank of the current processor
-// * \param n_proc is the number of processors
-// * \param z_thres is the threshold value in the z direction.
-// * \param comm The MPI communicator
-
-/*
+/*!
+ * \brief xy_bucket_rank returns the processor that keeps the directory of the x-y bucket #ix, #iy.
+ * See #SendReceive_PntsInfo
+ */
+int xy_bucket_rank(long long ix, long long iy, unsigned int n_proc){
+    unsigned long long h = static_cast<unsigned long long>(ix)*73856093ULL ^ static_cast<unsigned long long>(iy)*19349663ULL;
+    return static_cast<int>(h % n_proc);
+}
+
+/*!
+ * \brief xy_cover_buckets returns the x-y buckets that are closer than #xy_thres to the point #x, #y.
+ * The buckets have size 2*#xy_thres, so there are at most two of them along each direction.
+ * Two points that are closer than #xy_thres have at least the bucket of each one of them in common.
+ */
+void xy_cover_buckets(double x, double y, double xy_thres, std::vector<std::pair<long long, long long> >& buckets){
+    const double h = 2.0*xy_thres;
+    buckets.clear();
+    const long long ix0 = static_cast<long long>(std::floor((x - xy_thres)/h));
+    const long long ix1 = static_cast<long long>(std::floor((x + xy_thres)/h));
+    const long long iy0 = static_cast<long long>(std::floor((y - xy_thres)/h));
+    const long long iy1 = static_cast<long long>(std::floor((y + xy_thres)/h));
+    for (long long ix = ix0; ix <= ix1; ++ix){
+        for (long long iy = iy0; iy <= iy1; ++iy)
+            buckets.push_back(std::pair<long long, long long>(ix, iy));
+    }
+}
+
+/*!
+ * \brief SendReceive_PntsInfo sets the Top and Bottom of the local nodes of the columns that are shared with other processors.
+ * A column is shared if the part of it that this processor has contains nodes that are not locally owned. A processor that owns
+ * nodes of a column that spans many processors has in its part at least one node of the next processor (they share cells or
+ * ghost cells), therefore every processor that owns nodes of a shared column has the column as shared.
+ *
+ * The exchange is done in a fixed number of steps:
+ * - Each processor registers its shared columns to the directory of every x-y bucket that is closer than the xy threshold to the
+ * column. The directory of a bucket matches the parts of the same column, i.e. the parts that are closer than the threshold,
+ * and replies to each part the lowest (processor, column) of the matching parts. Because the parts of a column
+ * meet in the bucket of each one of them, all parts get the same answer regardless of where the bucket boundaries are.
+ * - Each processor sends its part of the column to that lowest processor, which is one of the processors that share the column.
+ * The parts are merged by the column id of the merging processor, follow the connected nodes along the complete column
+ * and the owner of each node gets its Top and Bottom.
+ *
+ * Only the Top/Bot that are not known (proc < 0) are updated. The connections of the nodes must have been set
+ * by #PntsInfo::set_ids_above_below.
+ * \param Columns is the structure of this processor
+ * \param xy_thres is the threshold for the x-y coordinates
+ * \param my_rank is the rank of this processor
+ * \param n_proc is the number of processors
+ * \param comm The MPI communicator
+ * \return the number of local nodes that still have an unknown Top or Bottom
+ */
 template <int dim>
-void SendReceive_PntsInfo(std::vector< std::vector<PntsInfo<dim> > > &Pnts,
-                          std::map<int , PntsInfo<dim> >& PointsMap,
-                          unsigned int my_rank,
-                          unsigned int n_proc,
-                          double z_thres,
-                          MPI_Comm comm){
-    std::map<int, int >::iterator it_cn;
-    typename std::map<int , PntsInfo<dim> >::iterator it_map;
-
-
-    std::vector<int> n_dofZ_per_proc(n_proc);
-    std::vector<std::vector<int> > dofZ(n_proc);
-    std::map<int,int> dof_key;
-    // First we will loop through the points that each processor has:
-    //Example :
-    // -I'm processor 0 and I will send first all the dofs that correspond to my points that I share with other processors
-    // In addition I'll keep a map where the keys will be the dof and the value a pair of
-    // indices........ (Not implement yet)
-    for (unsigned int i = 0; i < Pnts[my_rank].size(); ++i){
-        dofZ[my_rank].push_back(Pnts[my_rank][i].shared_proc.size()); // Number of processors that share the point
-        for (unsigned int k = 0; k < Pnts[my_rank][i].shared_proc.size(); ++k){
-            dofZ[my_rank].push_back(Pnts[my_rank][i].shared_proc[k]);// the processor that needs this point
-            dofZ[my_rank].push_back(Pnts[my_rank][i].key_val_shared_proc[k]);// the key in the processor list that needs this point
-        }
-        dofZ[my_rank].push_back(Pnts[my_rank][i].Zlist.size()); // the size of the dofs
-        for (unsigned int j = 0; j < Pnts[my_rank][i].Zlist.size(); ++j){
-            dofZ[my_rank].push_back(Pnts[my_rank][i].Zlist[j].dof);
+int SendReceive_PntsInfo(Column_store& Columns,
+                         double xy_thres,
+                         int my_rank,
+                         unsigned int n_proc,
+                         MPI_Comm comm){
+    // The shared columns of this processor
+    std::vector<int> shared_col;
+    for (int c = 0; c < Columns.n_columns(); ++c){
+        for (int k = Columns.col_ptr[c]; k < Columns.col_ptr[c+1]; ++k){
+            if (!Columns.has(k, ZF_LOCAL)){
+                shared_col.push_back(c);
+                break;
+            }
         }
     }
 
-    //if (my_rank == 1){
-    //    for (unsigned int i = 0; i < dofZ[my_rank].size(); ++i){
-    //        std::cout << "--- " << dofZ[my_rank][i] << std::endl;
-    //    }
-    //}
-    //return;
-    //Exchange the dofs of those points
-    Send_receive_size(static_cast<unsigned int>(dofZ[my_rank].size()), n_proc, n_dofZ_per_proc, comm);
-    Sent_receive_data<int>(dofZ, n_dofZ_per_proc, my_rank, comm, MPI_INT);
-
-    //print_size_msg(dofZ, my_rank);
-    //return;
-
-    std::vector<std::vector<int> > Request_dof(n_proc);
-    std::map<int,int> unique_list_req_dofs;
-    // now I will loop through the other processor dofs and I will find out which dofs I dont have and request for the remaining info
-    for (unsigned int i = 0; i < n_proc; ++i){
-        //std::cout << "-------------" << i << "------------" << std::endl;
-        if (i == my_rank)
-            continue;
-        std::vector<int> temp_dof_request;
-        unsigned int i_cnt = 0;
-        while(true){
-           // std::cout << i_cnt << std::endl;
-            int Nproc_share = get_v<int>(dofZ, i, i_cnt); i_cnt++;
-            //std::vector <int> shared_proc;
-            //std::vector <int> shared_proc_keys;
-            bool isthisme = false;
-            int mykey;
-            for (unsigned int k = 0; k < Nproc_share; ++k){
-                unsigned int iproc = get_v<int>(dofZ, i, i_cnt); i_cnt++;
-                int ikey = get_v<int>(dofZ, i, i_cnt); i_cnt++;
-                if (iproc == my_rank){ // if the shared processor is me I should check which dofs I am missing
-                    isthisme = true;
-                    mykey = ikey;
-                }
+    // Register the shared columns as the column id followed by its x and y
+    std::vector<std::pair<long long, long long> > buckets;
+    std::map<int, std::vector<Int_dbl_record<1,2> > > reg_send, reg_recv;
+    for (unsigned int ic = 0; ic < shared_col.size(); ++ic){
+        const int c = shared_col[ic];
+        Int_dbl_record<1,2> r;
+        r.i[0] = c;
+        r.d[0] = Columns.X[c];
+        r.d[1] = Columns.Y[c];
+        xy_cover_buckets(r.d[0], r.d[1], xy_thres, buckets);
+        std::set<int> dir_ranks;
+        for (unsigned int ib = 0; ib < buckets.size(); ++ib)
+            dir_ranks.insert(xy_bucket_rank(buckets[ib].first, buckets[ib].second, n_proc));
+        for (std::set<int>::iterator it = dir_ranks.begin(); it != dir_ranks.end(); ++it)
+            reg_send[*it].push_back(r);
+    }
+    Sparse_send_receive<Int_dbl_record<1,2> >(reg_send, reg_recv, comm, Int_dbl_record<1,2>::mpi_type(), 27);
+
+    // The directory keeps for each of its buckets the registered parts as (processor, column) and x-y
+    typedef std::pair<long long, long long> bucket_key;
+    typedef std::pair<int, int> part_key;
+    std::map<bucket_key, std::vector<std::pair<part_key, std::pair<double,double> > > > directory;
+    for (std::map<int, std::vector<Int_dbl_record<1,2> > >::iterator it = reg_recv.begin(); it != reg_recv.end(); ++it){
+        for (unsigned int i = 0; i < it->second.size(); ++i){
+            const Int_dbl_record<1,2>& r = it->second[i];
+            xy_cover_buckets(r.d[0], r.d[1], xy_thres, buckets);
+            for (unsigned int ib = 0; ib < buckets.size(); ++ib){
+                if (xy_bucket_rank(buckets[ib].first, buckets[ib].second, n_proc) != my_rank)
+                    continue;
+                directory[buckets[ib]].push_back(std::pair<part_key, std::pair<double,double> >(part_key(it->first, r.i[0]),
+                                                                                                std::pair<double,double>(r.d[0], r.d[1])));
             }
-            if (isthisme)
-                it_map = PointsMap.find(mykey);
-
-            int Ndofs = get_v<int>(dofZ, i, i_cnt); i_cnt++;// Number of dofs in this key
-            for (unsigned int k = 0; k < Ndofs; ++k){
-                int temp_dof = get_v<int>(dofZ, i, i_cnt); i_cnt++;
-                if (!isthisme) continue;
-                bool do_I_need = true;
-                // Check if I need this dof
-                if (it_map != PointsMap.end()){
-                    // find if the temp dof exist
-                    for (unsigned int kk = 0; kk < it_map->second.Zlist.size(); ++kk){
-                        if (temp_dof == it_map->second.Zlist[kk].dof){
-                            do_I_need = false;
-                            break;
-                        }
-                    }
-                    if (do_I_need){
-                        if (unique_list_req_dofs.find(temp_dof) == unique_list_req_dofs.end()){
-                            temp_dof_request.push_back(temp_dof);
-                            //if (my_rank == 2){
-                            //    std::cout << "rank 1 needs: " << temp_dof << " from " << i << std::endl;
-                            //}
-                            unique_list_req_dofs.insert(std::pair<int,int>(temp_dof, temp_dof));
-                        }
-                    }
-                }else {
-                    std::cout << "I didn't find the key" << std::endl;
-                }
+        }
+    }
 
+    // Each reply is the column id of the part followed by the lowest processor and its column id among the matching parts
+    std::map<int, std::vector<int> > root_send, root_recv;
+    for (std::map<bucket_key, std::vector<std::pair<part_key, std::pair<double,double> > > >::iterator itb = directory.begin();
+         itb != directory.end(); ++itb){
+        const std::vector<std::pair<part_key, std::pair<double,double> > >& parts = itb->second;
+        for (unsigned int i = 0; i < parts.size(); ++i){
+            part_key root = parts[i].first;
+            for (unsigned int j = 0; j < parts.size(); ++j){
+                if (std::abs(parts[i].second.first - parts[j].second.first) < xy_thres &&
+                        std::abs(parts[i].second.second - parts[j].second.second) < xy_thres)
+                    root = std::min(root, parts[j].first);
             }
-            if (i_cnt >= dofZ[i].size())
-                break;
+            std::vector<int>& rep = root_send[parts[i].first.first];
+            rep.push_back(parts[i].first.second);
+            rep.push_back(root.first);
+            rep.push_back(root.second);
         }
-        Request_dof[my_rank].push_back(i); // the processor we request the data from
-        Request_dof[my_rank].push_back(temp_dof_request.size()); //the total number number of dofs that we want from this processor
-        for (unsigned int k = 0; k < temp_dof_request.size(); ++k)
-            Request_dof[my_rank].push_back(temp_dof_request[k]);
     }
-    // The Request_dof vector holds in my_rank position the dofs that the my_rank position is missing.
-    std::vector<int> n_request_per_proc(n_proc);
-    Send_receive_size(static_cast<unsigned int>(Request_dof[my_rank].size()), n_proc, n_request_per_proc, comm);
-    Sent_receive_data<int>(Request_dof, n_request_per_proc, my_rank, comm, MPI_INT);
-
-    //print_size_msg(Request_dof, my_rank);
-    //return;
-
-    MPI_Barrier(comm);
-    if (my_rank == 2){
-        for (unsigned int i = 0; i < Request_dof[my_rank].size(); ++i){
-            std::cout << "Req: " << Request_dof[my_rank][i] << std::endl;
+    Sparse_send_receive<int>(root_send, root_recv, comm, MPI_INT, 28);
+
+    std::map<int, part_key> col_root;
+    for (std::map<int, std::vector<int> >::iterator it = root_recv.begin(); it != root_recv.end(); ++it){
+        for (unsigned int i = 0; i + 2 < it->second.size(); i += 3){
+            part_key root(it->second[i+1], it->second[i+2]);
+            std::map<int, part_key>::iterator itr = col_root.find(it->second[i]);
+            if (itr == col_root.end())
+                col_root.insert(std::pair<int, part_key>(it->second[i], root));
+            else
+                itr->second = std::min(itr->second, root);
         }
     }
-    return;
 
-    {
-        // now loop through the requested dofs and pack the data the other processors need
-        for (unsigned int i = 0; i < n_proc; ++i){
-            if (i == my_rank)
+    // Each node is sent as its dof, 1 if it is local, the dof below and the dof above if it is connected with them (-9 otherwise),
+    // the column id of the merging processor followed by its z
+    std::map<int, std::vector<Int_dbl_record<5,1> > > part_send, part_recv;
+    // The node index of the local nodes that are sent
+    std::map<int,int> local_id;
+    for (unsigned int ic = 0; ic < shared_col.size(); ++ic){
+        std::map<int, part_key>::iterator itr = col_root.find(shared_col[ic]);
+        if (itr == col_root.end())
+            continue;
+        PntsInfo<dim> pnt(Columns, shared_col[ic]);
+        std::vector<Int_dbl_record<5,1> >& part = part_send[itr->second.first];
+        for (int k = 0; k < pnt.size(); ++k){
+            Zinfo zk = pnt.Z(k);
+            if (zk.dof() < 0)
                 continue;
-
-            int i_cnt = 0;
-            while (true){
-                int proc2send = get_v<int>(Request_dof, i, i_cnt); i_cnt++;
-                int Ndofs_request = get_v<int>(Request_dof, i, i_cnt); i_cnt++;
-
-                for (unsigned int j = 0; j < Ndofs_from_proc; ++j){
-                    int req_dof = get_v<int>(Request_dof, i, i_cnt); i_cnt++;
-                    if (proc2send == my_rank){// if I am supposed to send this dof pack its data
-
-                    }
-                }
-
-                if (i_cnt >= Request_dof[i].size()){
-                    break;
-                }
-            }
-
+            Int_dbl_record<5,1> r;
+            r.i[0] = zk.dof();
+            r.i[1] = zk.is_local() ? 1 : 0;
+            r.i[2] = (k > 0 && zk.connected_below()) ? zk.dof_below() : -9;
+            r.i[3] = (k < pnt.size()-1 && zk.connected_above()) ? zk.dof_above() : -9;
+            r.i[4] = itr->second.second;
+            r.d[0] = zk.z();
+            part.push_back(r);
+            if (zk.is_local())
+                local_id[zk.dof()] = zk.id();
         }
-
     }
-
-
-
-
-    // serialize the information into 2 vectors int and double
-    std::vector<int> n_int_per_proc;
-    std::vector<int> n_dbl_per_proc;
-    std::vector<std::vector<int> > int_data(n_proc);
-    std::vector<std::vector<double> > dbl_data(n_proc);
-    int_data[my_rank].push_back(Pnts[my_rank].size()); // The 1st int is the number of Pnts NPnt this processor will transfer
-    for (unsigned int i = 0; i < Pnts[my_rank].size(); ++i){
-        //if (my_rank == 0) std::cout << "x: " << Pnts[my_rank][i].PNT[0] << std::endl;
-        dbl_data[my_rank].push_back(Pnts[my_rank][i].PNT[0]);
-        if (dim == 3){
-            //if (my_rank == 0) std::cout << "y " << Pnts[my_rank][i].PNT[1] << std::endl;
-            dbl_data[my_rank].push_back(Pnts[my_rank][i].PNT[1]);
+    Sparse_send_receive<Int_dbl_record<5,1> >(part_send, part_recv, comm, Int_dbl_record<5,1>::mpi_type(), 29);
+
+    // Merge the parts of each column. The nodes are kept as dof -> (z, owner).
+    // The elevation of the owner is used when the parts disagree
+    std::map<int, std::map<int, std::pair<double,int> > > col_nodes;
+    std::set<std::pair<int,int> > links;
+    for (std::map<int, std::vector<Int_dbl_record<5,1> > >::iterator it = part_recv.begin(); it != part_recv.end(); ++it){
+        for (unsigned int i = 0; i < it->second.size(); ++i){
+            const Int_dbl_record<5,1>& r = it->second[i];
+            std::map<int, std::pair<double,int> >& nodes = col_nodes[r.i[4]];
+            std::map<int, std::pair<double,int> >::iterator itn = nodes.find(r.i[0]);
+            if (itn == nodes.end())
+                nodes.insert(std::pair<int, std::pair<double,int> >(r.i[0], std::pair<double,int>(r.d[0], r.i[1] == 1 ? it->first : -9)));
+            else if (r.i[1] == 1)
+                itn->second = std::pair<double,int>(r.d[0], it->first);
+            if (r.i[2] >= 0)
+                links.insert(std::pair<int,int>(std::min(r.i[0], r.i[2]), std::max(r.i[0], r.i[2])));
+            if (r.i[3] >= 0)
+                links.insert(std::pair<int,int>(std::min(r.i[0], r.i[3]), std::max(r.i[0], r.i[3])));
         }
+    }
 
-        // For each pnt set the number of processors that share this point
-        int_data[my_rank].push_back(Pnts[my_rank][i].shared_proc.size());
-        // Next send the processors that should take this point
-        for (unsigned int ii = 0; ii < Pnts[my_rank][i].shared_proc.size(); ++ii){
-            int_data[my_rank].push_back(Pnts[my_rank][i].shared_proc[ii]);
+    // Follow the connected nodes of each complete column. Each reply is the dof, the bottom dof and its owner,
+    // the top dof and its owner followed by the bottom and top elevations
+    std::map<int, std::vector<Int_dbl_record<5,2> > > reply_send, reply_recv;
+    for (std::map<int, std::map<int, std::pair<double,int> > >::iterator itc = col_nodes.begin(); itc != col_nodes.end(); ++itc){
+        std::vector<std::pair<double,int> > order; // (z, dof)
+        for (std::map<int, std::pair<double,int> >::iterator itn = itc->second.begin(); itn != itc->second.end(); ++itn)
+            order.push_back(std::pair<double,int>(itn->second.first, itn->first));
+        std::sort(order.begin(), order.end());
+
+        const int N = static_cast<int>(order.size());
+        std::vector<int> bot(N), top(N);
+        for (int k = 0; k < N; ++k){
+            bot[k] = k;
+            if (k > 0 && links.count(std::pair<int,int>(std::min(order[k-1].second, order[k].second),
+                                                        std::max(order[k-1].second, order[k].second))))
+                bot[k] = bot[k-1];
         }
-        // Then send the number of points Nz in the Zlist list
-        int_data[my_rank].push_back(Pnts[my_rank][i].Zlist.size()); //number of Z coordinates Nz in the list
-        for (unsigned int j = 0; j < Pnts[my_rank][i].Zlist.size(); ++j){ // then send the following info Nz times
-            int_data[my_rank].push_back(Pnts[my_rank][i].Zlist[j].dof);     // dof
-            if (Pnts[my_rank][i].Zlist[j].isTop == 1) // instead of sending both top and bottom we will send 1 int depending the case
-                int_data[my_rank].push_back(1);
-            else if (Pnts[my_rank][i].Zlist[j].isBot == 1)
-                int_data[my_rank].push_back(2);
-            else
-                int_data[my_rank].push_back(0);
-            int_data[my_rank].push_back(Pnts[my_rank][i].Zlist[j].dof_conn.size());   // Send the number of connections Nconn for this point
-            for (it_cn = Pnts[my_rank][i].Zlist[j].dof_conn.begin(); it_cn != Pnts[my_rank][i].Zlist[j].dof_conn.end(); ++it_cn){// for each Nconn send the following
-                int_data[my_rank].push_back(it_cn->first); // the dof of the connected node
-                int_data[my_rank].push_back(it_cn->second); // hanging of the connected node
-            }
-            int_data[my_rank].push_back(Pnts[my_rank][i].Zlist[j].cnstr_nds.size());   // Send the number of constraints Nconn for this point
-            for (int jj = 0; jj < Pnts[my_rank][i].Zlist[j].cnstr_nds.size(); ++jj){// send the dofs that constraint this node
-                int_data[my_rank].push_back(Pnts[my_rank][i].Zlist[j].cnstr_nds[jj]);
-            }
-            // And last add the z value in the double vector
-            //if (my_rank == 0) std::cout << "z: " << Pnts[my_rank][i].Zlist[j].z << std::endl;
-            dbl_data[my_rank].push_back(Pnts[my_rank][i].Zlist[j].z);
+        for (int k = N-1; k >= 0; --k){
+            top[k] = k;
+            if (k < N-1 && links.count(std::pair<int,int>(std::min(order[k].second, order[k+1].second),
+                                                          std::max(order[k].second, order[k+1].second))))
+                top[k] = top[k+1];
         }
-    }
-    std::cout << "I'm rank " << my_rank << " and have to send " << dbl_data[my_rank].size()
-              << " doubles and " << int_data[my_rank].size() << " ints from " << int_data[my_rank][0] << " points" << std::endl;
-
-
-    // ------------------------- PASS DATA TO OTHER PROCESSORS
-    Send_receive_size(static_cast<unsigned int>(int_data[my_rank].size()), n_proc, n_int_per_proc, comm); // number of integers to transfer
-    Send_receive_size(static_cast<unsigned int>(dbl_data[my_rank].size()), n_proc, n_dbl_per_proc, comm); // number of doubles to transfer
-
-    Sent_receive_data<int>(int_data, n_int_per_proc, my_rank, comm, MPI_INT);
-    Sent_receive_data<double>(dbl_data, n_dbl_per_proc, my_rank, comm, MPI_DOUBLE);
-
-    //for (unsigned int i = 0; i < n_proc; ++i){
-    //    std::cout << "------I'm rank " << my_rank << " and I have from (" << i << ") " << int_data[i].size()
-    //              << " ints, and " <<  dbl_data[i].size() << " doubles------" << std::endl;
-    //}
-
-    // -----------------------------------------------------------------------------
-
-    // loop through the data and complete the Pnts vector for each processor
-    //int dbg_proc = 2;
-
-    for (unsigned int i_proc = 0; i_proc < int_data.size(); ++i_proc){ // loop through the processors
-        if (i_proc == my_rank)
-            continue;
-        unsigned int i_cnt = 0;
-        unsigned int d_cnt = 0;
-
-        // How many points my_rank gets from processor i_proc:
-        int Npnts = get_v<int>(int_data, i_proc, i_cnt);  i_cnt++;
-        //if (my_rank == dbg_proc) std::cout << "=========I'm rank " << my_rank << " and proc " << i_proc << " sends me " << Npnts << " pnts" << std::endl;
 
+        for (int k = 0; k < N; ++k){
+            const int owner = itc->second[order[k].second].second;
+            if (owner < 0)
+                continue;
+            Int_dbl_record<5,2> r;
+            r.i[0] = order[k].second;
+            r.i[1] = order[bot[k]].second;
+            r.i[2] = itc->second[r.i[1]].second;
+            r.i[3] = order[top[k]].second;
+            r.i[4] = itc->second[r.i[3]].second;
+            r.d[0] = order[bot[k]].first;
+            r.d[1] = order[top[k]].first;
+            reply_send[owner].push_back(r);
+        }
+    }
+    Sparse_send_receive<Int_dbl_record<5,2> >(reply_send, reply_recv, comm, Int_dbl_record<5,2>::mpi_type(), 30);
 
-        for (int i = 0; i < Npnts; ++i){
-            double x, y, z;
-            x = get_v<double>(dbl_data, i_proc, d_cnt);d_cnt++;
-            //if (my_rank == dbg_proc) std::cout << "-------I'm rank " << my_rank << ", x: " << x << std::endl;
-            if (dim == 3){
-                y = get_v<double>(dbl_data, i_proc, d_cnt);d_cnt++;
-            }
-            int Nshared_proc = get_v<int>(int_data, i_proc, i_cnt); i_cnt++;
-            std::vector<int> shared_proc;
-            for (int ii = 0; ii < Nshared_proc; ++ii){
-                shared_proc.push_back(get_v<int>(int_data, i_proc, i_cnt)); i_cnt++;
+    for (std::map<int, std::vector<Int_dbl_record<5,2> > >::iterator it = reply_recv.begin(); it != reply_recv.end(); ++it){
+        for (unsigned int i = 0; i < it->second.size(); ++i){
+            const Int_dbl_record<5,2>& r = it->second[i];
+            std::map<int,int>::iterator itl = local_id.find(r.i[0]);
+            if (itl == local_id.end())
+                continue;
+            Zinfo zn(Columns, itl->second);
+            if (zn.Bot().proc < 0 && r.i[2] >= 0){
+                zn.Bot().dof = r.i[1];
+                zn.Bot().proc = r.i[2];
+                zn.Bot().z = r.d[0];
             }
-
-            int Nz = get_v<int>(int_data, i_proc, i_cnt); i_cnt++;
-            //if (my_rank == dbg_proc) std::cout << "......I'm rank " << my_rank << ", Nz: " << Nz << std::endl;
-
-            for (int j = 0; j < Nz; ++j){
-                z = get_v<double>(dbl_data, i_proc, d_cnt); d_cnt++;
-                //if (my_rank == dbg_proc) std::cout << "- - - -I'm rank " << my_rank << ", z: " << z << std::endl;
-                int dof = get_v<int>(int_data, i_proc, i_cnt); i_cnt++;
-                //if (my_rank == dbg_proc) std::cout << "I'm rank " << my_rank << ", dof: " << dof << std::endl;
-                int top_bot_flag = get_v<int>(int_data, i_proc, i_cnt); i_cnt++;
-                int istop, isbot;
-                if (top_bot_flag == 1) {istop = 1;isbot=0;}
-                else if (top_bot_flag == 2){istop = 0;isbot=1;}
-                else{istop = 0;isbot=0;}
-
-                int Nconn = get_v<int>(int_data, i_proc, i_cnt); i_cnt++;
-                //if (my_rank == dbg_proc) std::cout << "I'm rank " << my_rank << ", Nconn: " << Nconn << std::endl;
-                std::map<int, int> conn;
-                for (int k = 0; k < Nconn; ++k){
-                    int c_dof = get_v<int>(int_data, i_proc, i_cnt); i_cnt++;
-                    //if (my_rank == dbg_proc) std::cout << "I'm rank " << my_rank << ", c_dof: " << c_dof << std::endl;
-                    int c_hng = get_v<int>(int_data, i_proc, i_cnt); i_cnt++;
-                    //if (my_rank == dbg_proc) std::cout << "I'm rank " << my_rank << ", c_hng: " << c_hng << std::endl;
-                    conn.insert(std::pair<int, int>(c_dof, c_hng));
-                }
-
-                int Ncnsrt = get_v<int>(int_data, i_proc, i_cnt); i_cnt++;
-                std::vector<int> cnstr_dofs;
-                for (int k = 0; k < Ncnsrt; ++k){
-                    cnstr_dofs.push_back(get_v<int>(int_data, i_proc, i_cnt));i_cnt++;
-                }
-
-                Zinfo zinfo(z, dof, cnstr_dofs, istop, isbot, conn);
-                Point<dim-1> p;
-                p[0] = x;
-                if (dim == 3)
-                    p[1] = y;
-
-                if (j == 0){
-                    PntsInfo<dim> pntinfo(p,zinfo);
-                    pntinfo.shared_proc = shared_proc;
-                    Pnts[i_proc].push_back(pntinfo);
-                }else{
-                    Pnts[i_proc][Pnts[i_proc].size()-1].add_Zcoord(zinfo, z_thres);
-                }
+            if (zn.Top().proc < 0 && r.i[4] >= 0){
+                zn.Top().dof = r.i[3];
+                zn.Top().proc = r.i[4];
+                zn.Top().z = r.d[1];
             }
         }
     }
+
+    int n_unknown = 0;
+    for (int i = 0; i < Columns.n_nodes(); ++i){
+        if (Columns.has(i, ZF_LOCAL) && (Columns.Bot[i].proc < 0 || Columns.Top[i].proc < 0))
+            n_unknown++;
+    }
+    return n_unknown;
 }
-*/
 
 
 
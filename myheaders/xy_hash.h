@@ -0,0 +1,118 @@
+#ifndef XY_HASH_H
+#define XY_HASH_H
+
+#include <vector>
+#include <unordered_map>
+#include <cmath>
+
+/*!
+ * \brief The XY_hash class is a uniform spatial hash of the x-y column locations.
+ *
+ * The x-y plane is split into square buckets with size equal to the x-y threshold. Two points that are closer than the
+ * threshold are therefore either in the same or in neighbouring buckets, so a query has to check at most 9 buckets (3 in 2D).
+ * The ids of each bucket are chained through the #next array so that there are no allocations per bucket.
+ * The class does not store the coordinates. These are passed by the caller and they are typically the #Column_store::X and
+ * #Column_store::Y arrays.
+ */
+class XY_hash{
+public:
+    //! Deletes everything and sets the bucket size
+    void reinit(double thres);
+
+    //! Adds the point #id at #x, #y. The ids must be consecutive starting from 0.
+    void insert(int id, double x, double y);
+
+    /*!
+     * \brief find returns the ids of the points that are closer than the threshold to #x, #y
+     * \param x, y are the coordinates of the point in question
+     * \param X, Y are the coordinates of all points indexed by id
+     * \param ids is the list of the points found within the threshold
+     */
+    void find(double x, double y,
+              const std::vector<double>& X,
+              const std::vector<double>& Y,
+              std::vector<int>& ids) const;
+
+private:
+    long long key(long long ix, long long iy) const{
+        // Shift the unsigned bits, because the shift of a negative signed value is undefined
+        return static_cast<long long>((static_cast<unsigned long long>(ix) << 32) ^
+                                      (static_cast<unsigned long long>(iy) & 0xffffffffULL));
+    }
+
+    //! The bucket size
+    double h;
+
+    //! The first id of each non empty bucket
+    std::unordered_map<long long, int> head;
+
+    //! The next id in the same bucket or -1
+    std::vector<int> next;
+};
+
+void XY_hash::reinit(double thres){
+    h = thres;
+    head.clear();
+    next.clear();
+}
+
+void XY_hash::insert(int id, double x, double y){
+    long long k = key(static_cast<long long>(std::floor(x/h)), static_cast<long long>(std::floor(y/h)));
+    if (static_cast<int>(next.size()) <= id)
+        next.resize(id+1, -1);
+    std::unordered_map<long long, int>::iterator it = head.find(k);
+    if (it == head.end()){
+        head.insert(std::pair<long long, int>(k, id));
+    }else{
+        next[id] = it->second;
+        it->second = id;
+    }
+}
+
+void XY_hash::find(double x, double y,
+                   const std::vector<double>& X,
+                   const std::vector<double>& Y,
+                   std::vector<int>& ids) const{
+    ids.clear();
+    long long ix = static_cast<long long>(std::floor(x/h));
+    long long iy = static_cast<long long>(std::floor(y/h));
+    for (long long i = ix - 1; i <= ix + 1; ++i){
+        for (long long j = iy - 1; j <= iy + 1; ++j){
+            std::unordered_map<long long, int>::const_iterator it = head.find(key(i, j));
+            if (it == head.end())
+                continue;
+            for (int id = it->second; id >= 0; id = next[id]){
+                double dx = X[id] - x;
+                double dy = Y[id] - y;
+                if (dx*dx + dy*dy < h*h)
+                    ids.push_back(id);
+            }
+        }
+    }
+}
+
+//! Spreads the lower 32 bits of #v to the even bits of the result
+inline unsigned long long spread_bits(unsigned long long v){
+    v &= 0xffffffffULL;
+    v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+    v = (v | (v << 8))  & 0x00ff00ff00ff00ffULL;
+    v = (v | (v << 4))  & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | (v << 2))  & 0x3333333333333333ULL;
+    v = (v | (v << 1))  & 0x5555555555555555ULL;
+    return v;
+}
+
+/*!
+ * \brief xy_morton_key returns the Morton (Z order) key of the x-y location. The locations are split into square
+ * buckets of size #h starting from #x0, #y0 and the bits of the bucket indices are interleaved, so that the locations
+ * that are close to each other get close keys.
+ */
+inline unsigned long long xy_morton_key(double x, double y, double x0, double y0, double h){
+    double fx = std::floor((x - x0)/h);
+    double fy = std::floor((y - y0)/h);
+    unsigned long long ix = fx < 0 ? 0 : (fx > 4294967295.0 ? 4294967295ULL : static_cast<unsigned long long>(fx));
+    unsigned long long iy = fy < 0 ? 0 : (fy > 4294967295.0 ? 4294967295ULL : static_cast<unsigned long long>(fy));
+    return spread_bits(ix) | (spread_bits(iy) << 1);
+}
+
+#endif // XY_HASH_H